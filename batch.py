@@ -1,35 +1,22 @@
 #!/bin/python
 
-# Usage: ./main <exr image> <map image> <simple image> <fusion image>
+# Usage: ./main --batch <manifest>
+# manifest lines: <exr image> <map image> <simple image> <fusion image>
 
 import subprocess
-import threading
+import tempfile
 
 task = [i for i in range(1, 19 + 1)]
 
-class Worker(threading.Thread):
-	def run(self):
-		try:
-			while True:
-				i = task.pop()
-				print("Process:", i)
+with tempfile.NamedTemporaryFile("w", suffix=".txt") as manifest:
+	for i in task:
+		exrFile = "ori/render_result_nm_ori_%s.exr" % i
+		mapFile = "map/map_%s.png" % i
+		simpleFile = "simple/simple_%s.png" % i
+		fusionFile = "fusion/fusion_%s.png" % i
 
-				exrFile = "ori/render_result_nm_ori_%s.exr" % i
-				mapFile = "map/map_%s.png" % i
-				simpleFile = "simple/simple_%s.png" % i
-				fusionFile = "fusion/fusion_%s.png" % i
+		manifest.write("%s %s %s %s\n" % (exrFile, mapFile, simpleFile, fusionFile))
+	manifest.flush()
 
-				subprocess.call("./main %s %s %s %s" % (exrFile, mapFile, simpleFile, fusionFile), shell=True)
-
-		except IndexError as e:
-			pass
-
-worker = []
-
-for i in range(4):
-	w = Worker()
-	w.start()
-	worker.append(w)
-
-for w in worker:
-	w.join()
+	# one process tone maps the images, two at a time, sharing the cores
+	subprocess.call(["./main", "--jobs", "2", "--batch", manifest.name])
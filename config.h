@@ -27,7 +27,7 @@
 #endif
 
 
-#if 1
+#if 1 && !defined(NO_FFTW3F)
   #define HAVE_FFTW3F
 #endif
 
@@ -22,9 +22,11 @@ double getMSE(Mat I1, Mat I2) {
 
  }
 
-int main () {
-	Mat image1 = imread("fusion.jpg");
-	Mat image2 = imread("fusion2.jpg");
+// compares two renderings, e.g. a default run against --half-planes:
+// diff [image1 image2]
+int main (int argc, char* argv[]) {
+	Mat image1 = imread(argc > 2 ? argv[1] : "fusion.jpg");
+	Mat image2 = imread(argc > 2 ? argv[2] : "fusion2.jpg");
 
 	resize(image1, image1, Size(800, 600));
 	resize(image2, image2, Size(800, 600));
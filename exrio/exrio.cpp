@@ -28,24 +28,322 @@
 #include <config.h>
 
 #include <iostream>
+#include <algorithm>
+#include <vector>
+#include <set>
 
 #include <math.h>
+#include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <stddef.h>
+#include <omp.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_F16C_TARGET
+#include <immintrin.h>
+#endif
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <pfs.h>
 #include "exrio.h"
 
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfThreading.h>
+#include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <Iex.h>
+
 using namespace std;
 
 using namespace Imf;
 using namespace Imath;
 
-OpenEXRReader::OpenEXRReader( const char* filename )
+static double wallTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Y row of the RGB->XYZ matrix used by pfs::transformColorSpace
+static const float rgb2yD65[3] = { 0.212656f, 0.715158f, 0.072186f };
+
+static void computeLuminance( const float *R, const float *G, const float *B,
+			      float *Y, int size )
+{
+  #pragma omp parallel for
+  for( int i=0 ; i<size ; i++ )
+    Y[i] = rgb2yD65[0]*R[i] + rgb2yD65[1]*G[i] + rgb2yD65[2]*B[i];
+}
+
+#ifdef HAVE_F16C_TARGET
+// the build targets CPUs without F16C (corei7-avx), so these are compiled
+// for it separately and only called when the CPU has it
+__attribute__((target("avx,f16c")))
+static size_t floatToHalfF16c( const float *src, half *dst, size_t size )
+{
+  const __m256 lo = _mm256_set1_ps(-HALF_MAX), hi = _mm256_set1_ps(HALF_MAX);
+  size_t i = 0;
+  for( ; i+8<=size ; i+=8 )
+  {
+    __m256 v = _mm256_loadu_ps(src+i);
+    v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q));	// NaN -> 0
+    v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t halfToFloatF16c( const half *src, float *dst, size_t size )
+{
+  size_t i = 0;
+  for( ; i+8<=size ; i+=8 )
+    _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+i))));
+  return i;
+}
+
+static bool detectF16c()
+{
+  // may run before the constructor that initialises the cpu model
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("f16c");
+}
+
+static const bool hasF16c = detectF16c();
+#endif
+
+void floatToHalf( const float *src, half *dst, size_t size )
+{
+  size_t i = 0;
+#ifdef HAVE_F16C_TARGET
+  if( hasF16c )
+    i = floatToHalfF16c(src, dst, size);
+#endif
+  for( ; i<size ; i++ )
+  {
+    float v = src[i]==src[i] ? src[i] : 0.0f;
+    dst[i] = v<-HALF_MAX ? -HALF_MAX : (v>HALF_MAX ? HALF_MAX : v);
+  }
+}
+
+void halfToFloat( const half *src, float *dst, size_t size )
+{
+  size_t i = 0;
+#ifdef HAVE_F16C_TARGET
+  if( hasF16c )
+    i = halfToFloatF16c(src, dst, size);
+#endif
+  for( ; i<size ; i++ )
+    dst[i] = src[i];
+}
+
+// rows of a decoding band: about 8 MB of float R, G, B and Y, so the
+// luminance and half conversion passes find the band still in cache
+// whatever the thread count, but at least one 32 row scanline block
+// (PIZ, B44) so compressed blocks are not decoded twice
+static int bandHeight( int width )
+{
+  const size_t bandBytes = 8<<20;
+  return max(32, (int)(bandBytes / ((size_t)4*sizeof(float)*width)));
+}
+
+int setupExrThreads( int threads )
+{
+  if( threads<=0 )
+    threads = omp_get_max_threads();
+
+  // the per-file thread count only takes effect up to the global pool size
+  if( globalThreadCount()<threads )
+    setGlobalThreadCount(threads);
+
+  return threads;
+}
+
+/**
+ * Input stream over a read-only memory mapping of the whole file. OpenEXR
+ * asks isMemoryMapped() and then takes pixel data through
+ * readMemoryMapped() as pointers into the page cache, without copies.
+ */
+class MappedIStream : public IStream
+{
+  char* data;
+  Int64 size;
+  Int64 pos;
+
+public:
+  MappedIStream( const char* filename ) : IStream( filename ), data( NULL ), size( 0 ), pos( 0 )
+  {
+    int fd = open(filename, O_RDONLY);
+    if( fd<0 )
+      throw pfs::Exception("EXR: cannot open file for mapping");
+
+    struct stat st;
+    if( fstat(fd, &st)!=0 || st.st_size<=0 )
+    {
+      close(fd);
+      throw pfs::Exception("EXR: cannot map empty file");
+    }
+    size = st.st_size;
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map==MAP_FAILED )
+      throw pfs::Exception("EXR: mmap failed");
+    data = (char*)map;
+
+    // pixel data is consumed front to back
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+
+  ~MappedIStream()
+  {
+    munmap(data, size);
+  }
+
+  bool isMemoryMapped() const
+  {
+    return true;
+  }
+
+  bool read( char c[], int n )
+  {
+    if( pos+n>size )
+      throw Iex::InputExc("Unexpected end of file.");
+    memcpy(c, data+pos, n);
+    pos += n;
+    return pos<size;
+  }
+
+  char* readMemoryMapped( int n )
+  {
+    if( pos+n>size )
+      throw Iex::InputExc("Unexpected end of file.");
+    char* p = data+pos;
+    pos += n;
+    return p;
+  }
+
+  Int64 tellg()
+  {
+    return pos;
+  }
+
+  void seekg( Int64 p )
+  {
+    pos = p;
+  }
+};
+
+static bool hasRgbChannels( const Header& header, const string& prefix )
+{
+  const ChannelList& channels = header.channels();
+  return channels.findChannel(prefix + "R")!=NULL &&
+    channels.findChannel(prefix + "G")!=NULL &&
+    channels.findChannel(prefix + "B")!=NULL;
+}
+
+OpenEXRReader::OpenEXRReader( const char* filename, ReadMode mode, int threads,
+			      bool mapped ) :
+  stream( NULL ), file( NULL ), part( NULL ), mode( mode ), decodeTime( 0.0 )
+{
+  strncpy(fileName, filename, sizeof(fileName)-1);
+  fileName[sizeof(fileName)-1] = 0;
+
+  this->threads = setupExrThreads(threads);
+
+  // the destructor does not run when the constructor throws, so the
+  // mapping and the file are released here for files that are rejected
+  try
+  {
+    //--- read image
+    try
+    {
+      if( mapped )
+      {
+        stream = new MappedIStream(filename);
+        file = new MultiPartInputFile(*stream, this->threads);
+      }
+      else
+        file = new MultiPartInputFile(filename, this->threads);
+    }
+    catch (const std::exception &exc)
+    {
+      throw pfs::Exception( exc.what() );
+    }
+
+    requestedMode = mode;
+    selectLayer(NULL);
+  }
+  catch (...)
+  {
+    delete part;
+    delete file;
+    delete stream;
+    throw;
+  }
+
+  DEBUG_STR << "OpenEXR file \"" << filename << "\" ("
+	    << width << "x" << height << ", " << file->parts() << " parts)" << endl;
+}
+
+vector<string> OpenEXRReader::getLayers() const
+{
+  vector<string> layers;
+  for( int p=0 ; p<file->parts() ; p++ )
+  {
+    const Header& header = file->header(p);
+    if( hasRgbChannels(header, "") )
+      layers.push_back(header.hasName() ? header.name() : string());
+
+    set<string> names;
+    header.channels().layers(names);
+    for( set<string>::const_iterator it=names.begin() ; it!=names.end() ; it++ )
+      if( hasRgbChannels(header, *it + ".") )
+        layers.push_back(*it);
+  }
+  return layers;
+}
+
+void OpenEXRReader::selectLayer( const char* name )
 {
-  //--- read image
-  file = new RgbaInputFile(filename);
-  dw = file->dataWindow();
+  string requested = name!=NULL ? name : "";
+  int found = -1;
+  string prefix;
 
+  for( int p=0 ; p<file->parts() && found<0 ; p++ )
+  {
+    const Header& header = file->header(p);
+    if( requested.empty() )
+    {
+      found = p;
+    }
+    else if( header.hasName() && header.name()==requested && hasRgbChannels(header, "") )
+    {
+      found = p;
+    }
+    else if( hasRgbChannels(header, requested + ".") )
+    {
+      found = p;
+      prefix = requested + ".";
+    }
+  }
+
+  if( found<0 )
+    throw pfs::Exception("EXR: no such layer");
+
+  delete part;
+  part = new InputPart(*file, found);
+  partNumber = found;
+  layer = requested;
+  channelPrefix = prefix;
+
+  dw = part->header().dataWindow();
   width  = dw.max.x - dw.min.x + 1;
   height = dw.max.y - dw.min.y + 1;
   
@@ -54,23 +352,20 @@ OpenEXRReader::OpenEXRReader( const char* filename )
     throw pfs::Exception("EXR: illegal image size");
   }
 
-  DEBUG_STR << "OpenEXR file \"" << filename << "\" ("
-	    << width << "x" << height << ")" << endl;
+  // luminance/chroma and other exotic layouts need RgbaInputFile
+  // conversion, which is only available for the first part
+  mode = partNumber==0 ? requestedMode : READ_PLANAR;
+  if( !hasRgbChannels(part->header(), channelPrefix) )
+  {
+    if( partNumber!=0 )
+      throw pfs::Exception("EXR: layer has no R, G, B channels");
+    mode = READ_RGBA;
+  }
 }
 
 void OpenEXRReader::readImage( pfs::Array2D *R, pfs::Array2D *G,
 			       pfs::Array2D *B )
 {
-  assert(file!=NULL);
-  DEBUG_STR << "Reading OpenEXR file... " << endl;
-  
-  Imf::Rgba* tmp_img = new Imf::Rgba[width*height];
-
-  assert( dw.min.x - dw.min.y * width<=0 );
-  file->setFrameBuffer(tmp_img - dw.min.x - dw.min.y * width, 1, width);
-  // read image to memory
-  file->readPixels(dw.min.y, dw.max.y);
-
   // check if supplied matrixes have the same size as the image
   if( R->getCols()!=width || R->getRows()!=height ||
       G->getCols()!=width || G->getRows()!=height ||
@@ -79,6 +374,272 @@ void OpenEXRReader::readImage( pfs::Array2D *R, pfs::Array2D *G,
     throw pfs::Exception("EXR: matrixes have different size than image");
   }
 
+  // planar decoding needs contiguous row-major storage
+  pfs::Array2DImpl *rImpl = dynamic_cast<pfs::Array2DImpl*>(R);
+  pfs::Array2DImpl *gImpl = dynamic_cast<pfs::Array2DImpl*>(G);
+  pfs::Array2DImpl *bImpl = dynamic_cast<pfs::Array2DImpl*>(B);
+
+  if( mode==READ_PLANAR && rImpl!=NULL && gImpl!=NULL && bImpl!=NULL )
+    readImage(rImpl->getRawData(), gImpl->getRawData(), bImpl->getRawData());
+  else
+  {
+    double start = wallTime();
+    readImageRgba(R, G, B);
+    decodeTime = wallTime() - start;
+  }
+}
+
+void OpenEXRReader::readImage( float *R, float *G, float *B, float *Y )
+{
+  readRegion(0, 0, width, height, R, G, B, Y);
+}
+
+void OpenEXRReader::setPlanarFrameBuffer( float *R, float *G, float *B, int firstRow )
+{
+  // slices are addressed in data window coordinates, firstRow maps to R[0]
+  const size_t xStride = sizeof(float);
+  const size_t yStride = sizeof(float) * width;
+  const ptrdiff_t origin = - dw.min.x - (ptrdiff_t)firstRow * width;
+
+  FrameBuffer frameBuffer;
+  frameBuffer.insert(channelPrefix + "R", Slice(FLOAT, (char*)(R + origin), xStride, yStride));
+  frameBuffer.insert(channelPrefix + "G", Slice(FLOAT, (char*)(G + origin), xStride, yStride));
+  frameBuffer.insert(channelPrefix + "B", Slice(FLOAT, (char*)(B + origin), xStride, yStride));
+  part->setFrameBuffer(frameBuffer);
+}
+
+void OpenEXRReader::readRegion( int x, int y, int w, int h,
+				float *R, float *G, float *B, float *Y )
+{
+  assert(part!=NULL);
+
+  if( x<0 || y<0 || w<=0 || h<=0 || x+w>width || y+h>height )
+    throw pfs::Exception("EXR: region outside of the data window");
+
+  double start = wallTime();
+
+  if( mode!=READ_PLANAR )
+  {
+    pfs::Array2DImpl rPlane(width, height), gPlane(width, height), bPlane(width, height);
+    readImageRgba(&rPlane, &gPlane, &bPlane);
+    for( int row=0 ; row<h ; row++ )
+    {
+      size_t src = (size_t)(y+row)*width + x;
+      size_t dst = (size_t)row*w;
+      memcpy(R+dst, rPlane.getRawData()+src, sizeof(float)*w);
+      memcpy(G+dst, gPlane.getRawData()+src, sizeof(float)*w);
+      memcpy(B+dst, bPlane.getRawData()+src, sizeof(float)*w);
+    }
+    if( Y!=NULL )
+      computeLuminance(R, G, B, Y, w*h);
+    decodeTime = wallTime() - start;
+    return;
+  }
+
+  DEBUG_STR << "Reading OpenEXR file (planar)... " << endl;
+
+  const int band = bandHeight(width);
+  const int bandRows = min(band, h);
+
+  // partial rows are decoded into a full-width band and then cropped,
+  // full rows go straight into the destination
+  const bool fullRows = (x==0 && w==width);
+  vector<float> bandBuffer( fullRows ? 0 : (size_t)3*width*bandRows );
+
+  try
+  {
+    const int yFirst = dw.min.y + y;
+    const int yLast = yFirst + h - 1;
+    const int step = (fullRows && Y==NULL) ? h : band;
+
+    for( int y0=yFirst ; y0<=yLast ; y0+=step )
+    {
+      int y1 = min(y0+step-1, yLast);
+      size_t offset = (size_t)(y0-yFirst) * w;
+
+      if( fullRows )
+      {
+        setPlanarFrameBuffer(R+offset, G+offset, B+offset, y0);
+        part->readPixels(y0, y1);
+      }
+      else
+      {
+        float *bandR = &bandBuffer[0];
+        float *bandG = bandR + (size_t)width*bandRows;
+        float *bandB = bandG + (size_t)width*bandRows;
+        setPlanarFrameBuffer(bandR, bandG, bandB, y0);
+        part->readPixels(y0, y1);
+
+        for( int row=0 ; row<=y1-y0 ; row++ )
+        {
+          size_t src = (size_t)row*width + x;
+          size_t dst = offset + (size_t)row*w;
+          memcpy(R+dst, bandR+src, sizeof(float)*w);
+          memcpy(G+dst, bandG+src, sizeof(float)*w);
+          memcpy(B+dst, bandB+src, sizeof(float)*w);
+        }
+      }
+
+      if( Y!=NULL )
+        computeLuminance(R+offset, G+offset, B+offset, Y+offset, (y1-y0+1)*w);
+    }
+  }
+  catch (const std::exception &exc)
+  {
+    throw pfs::Exception( exc.what() );
+  }
+
+  decodeTime = wallTime() - start;
+}
+
+void OpenEXRReader::readRegion( int x, int y, int w, int h,
+				half *R, half *G, half *B, float *Y )
+{
+  // the RGBA fallback decodes the whole frame anyway, so it is read at once
+  const int band = mode==READ_PLANAR ? bandHeight(w) : h;
+  const int bandRows = min(band, h);
+  vector<float> bandBuffer( (size_t)3*w*bandRows );
+  float *bandR = &bandBuffer[0];
+  float *bandG = bandR + (size_t)w*bandRows;
+  float *bandB = bandG + (size_t)w*bandRows;
+
+  double time = 0.0;
+  for( int row=0 ; row<h ; row+=band )
+  {
+    int rows = min(band, h-row);
+    size_t offset = (size_t)row * w;
+    readRegion(x, y+row, w, rows, bandR, bandG, bandB, Y!=NULL ? Y+offset : NULL);
+    time += decodeTime;
+
+    double start = wallTime();
+    floatToHalf(bandR, R+offset, (size_t)w*rows);
+    floatToHalf(bandG, G+offset, (size_t)w*rows);
+    floatToHalf(bandB, B+offset, (size_t)w*rows);
+    time += wallTime() - start;
+  }
+  decodeTime = time;
+}
+
+void OpenEXRReader::readPreview( int factor, half *R, half *G, half *B, float *Y )
+{
+  // previews are small, decode at full precision and convert
+  const size_t size = (size_t)getPreviewWidth(factor) * getPreviewHeight(factor);
+  vector<float> buffer( 3*size );
+  readPreview(factor, &buffer[0], &buffer[size], &buffer[2*size], Y);
+
+  double start = wallTime();
+  floatToHalf(&buffer[0], R, size);
+  floatToHalf(&buffer[size], G, size);
+  floatToHalf(&buffer[2*size], B, size);
+  decodeTime += wallTime() - start;
+}
+
+void OpenEXRReader::readPreview( int factor, float *R, float *G, float *B, float *Y )
+{
+  assert(part!=NULL);
+
+  if( factor<1 )
+    throw pfs::Exception("EXR: illegal preview factor");
+
+  const int pw = getPreviewWidth(factor);
+  const int ph = getPreviewHeight(factor);
+
+  double start = wallTime();
+
+  if( mode!=READ_PLANAR )
+  {
+    pfs::Array2DImpl rPlane(width, height), gPlane(width, height), bPlane(width, height);
+    readImageRgba(&rPlane, &gPlane, &bPlane);
+    for( int py=0 ; py<ph ; py++ )
+      for( int px=0 ; px<pw ; px++ )
+      {
+        size_t src = (size_t)py*factor*width + px*factor;
+        size_t dst = (size_t)py*pw + px;
+        R[dst] = rPlane(src);
+        G[dst] = gPlane(src);
+        B[dst] = bPlane(src);
+      }
+  }
+  else
+  {
+    DEBUG_STR << "Reading OpenEXR preview 1/" << factor << "... " << endl;
+
+    vector<float> row( (size_t)3*width );
+    float *rowR = &row[0];
+    float *rowG = rowR + width;
+    float *rowB = rowG + width;
+
+    try
+    {
+      for( int py=0 ; py<ph ; py++ )
+      {
+        // the line buffer of a block is kept, so scanlines sharing a
+        // block are decompressed only once
+        int y = dw.min.y + py*factor;
+        setPlanarFrameBuffer(rowR, rowG, rowB, y);
+        part->readPixels(y, y);
+
+        float *dstR = R + (size_t)py*pw;
+        float *dstG = G + (size_t)py*pw;
+        float *dstB = B + (size_t)py*pw;
+        for( int px=0 ; px<pw ; px++ )
+        {
+          dstR[px] = rowR[px*factor];
+          dstG[px] = rowG[px*factor];
+          dstB[px] = rowB[px*factor];
+        }
+      }
+    }
+    catch (const std::exception &exc)
+    {
+      throw pfs::Exception( exc.what() );
+    }
+  }
+
+  if( Y!=NULL )
+    computeLuminance(R, G, B, Y, pw*ph);
+
+  decodeTime = wallTime() - start;
+}
+
+void OpenEXRReader::readImageRgba( pfs::Array2D *R, pfs::Array2D *G,
+				   pfs::Array2D *B )
+{
+  DEBUG_STR << "Reading OpenEXR file... " << endl;
+  
+  // RgbaInputFile decodes the first part only (see selectLayer), its layer
+  // is the resolved channel prefix: a named part without prefixed
+  // channels is read as R, G, B and not as <name>.R, <name>.G, <name>.B
+  assert( partNumber==0 );
+  string rgbaLayer = channelPrefix.empty() ? string() :
+    channelPrefix.substr(0, channelPrefix.size()-1);
+
+  RgbaInputFile* rgbaFile = NULL;
+  Imf::Rgba* tmp_img = new Imf::Rgba[width*height];
+  try
+  {
+    // a mapped file is read again from its mapping
+    if( stream!=NULL )
+    {
+      stream->seekg(0);
+      rgbaFile = new RgbaInputFile(*stream, rgbaLayer, threads);
+    }
+    else
+      rgbaFile = new RgbaInputFile(fileName, rgbaLayer, threads);
+
+    assert( dw.min.x - dw.min.y * width<=0 );
+    rgbaFile->setFrameBuffer(tmp_img - dw.min.x - dw.min.y * width, 1, width);
+    // read image to memory
+    rgbaFile->readPixels(dw.min.y, dw.max.y);
+  }
+  catch (const std::exception &exc)
+  {
+    delete rgbaFile;
+    delete[] tmp_img;
+    throw pfs::Exception( exc.what() );
+  }
+  delete rgbaFile;
+
   int idx=0;
   for( int y=0 ; y<height ; y++ )
     for( int x=0 ; x<width ; x++ )
@@ -88,18 +649,24 @@ void OpenEXRReader::readImage( pfs::Array2D *R, pfs::Array2D *G,
       (*B)(x,y) = tmp_img[idx].b;
       idx++;
     }
-  delete tmp_img;
+  delete[] tmp_img;
 }
 
 OpenEXRReader::~OpenEXRReader()
 {
+  delete part;
+  part=NULL;
   delete file;
-  file==NULL;
+  file=NULL;
+  delete stream;
+  stream=NULL;
 }
 
-OpenEXRWriter::OpenEXRWriter(const char* filename)
+OpenEXRWriter::OpenEXRWriter(const char* filename, int threads) :
+  compression( ZIP_COMPRESSION ), pixelType( HALF ), tileSize( 0 )
 {
   strcpy(fileName, filename);
+  this->threads = setupExrThreads(threads);
 }
 
 void OpenEXRWriter::writeImage( pfs::Array2D *R, pfs::Array2D *G,
@@ -109,28 +676,140 @@ void OpenEXRWriter::writeImage( pfs::Array2D *R, pfs::Array2D *G,
   int width = R->getCols();
   int height = R->getRows();
 
-  Imf::Rgba* tmp_img = new Imf::Rgba[width*height];
-  int idx=0;
-  for( int y=0 ; y<height ; y++ )
-    for( int x=0 ; x<width ; x++ )
-    {
-      tmp_img[idx].r = (*R)(x,y);
-      tmp_img[idx].g = (*G)(x,y);
-      tmp_img[idx].b = (*B)(x,y);
-      tmp_img[idx].a = 1.0f;
-      idx++;
-    }
+  pfs::Array2DImpl *rImpl = dynamic_cast<pfs::Array2DImpl*>(R);
+  pfs::Array2DImpl *gImpl = dynamic_cast<pfs::Array2DImpl*>(G);
+  pfs::Array2DImpl *bImpl = dynamic_cast<pfs::Array2DImpl*>(B);
+
+  if( rImpl!=NULL && gImpl!=NULL && bImpl!=NULL )
+  {
+    writeImage(rImpl->getRawData(), gImpl->getRawData(), bImpl->getRawData(),
+	       width, height);
+    return;
+  }
+
+  // other Array2D implementations do not expose their storage
+  pfs::Array2DImpl rPlane(width, height), gPlane(width, height), bPlane(width, height);
+  pfs::copyArray(R, &rPlane);
+  pfs::copyArray(G, &gPlane);
+  pfs::copyArray(B, &bPlane);
+  writeImage(rPlane.getRawData(), gPlane.getRawData(), bPlane.getRawData(),
+	     width, height);
+}
+
+void OpenEXRWriter::writeImage( const float *R, const float *G, const float *B,
+				int width, int height, int stride )
+{
+  // file channels are sorted by name, the order here does not matter
+  const char* const names[] = { "R", "G", "B" };
+  const float* const planes[] = { R, G, B };
+  writePlanes(names, planes, 3, width, height, stride);
+}
+
+void OpenEXRWriter::writeLuminance( const float *Y, int width, int height, int stride )
+{
+  const char* const names[] = { "Y" };
+  const float* const planes[] = { Y };
+  writePlanes(names, planes, 1, width, height, stride);
+}
+
+void OpenEXRWriter::writePlanes( const char* const names[], const float* const planes[],
+				 int count, int width, int height, int stride )
+{
+  if( stride<=0 )
+    stride = width;
+
+  Header header(width, height);
+  header.compression() = compression;
+  if( tileSize>0 )
+    header.setTileDescription(TileDescription(tileSize, tileSize, ONE_LEVEL));
+
+  // the library converts the float slices to half while compressing
+  FrameBuffer frameBuffer;
+  for( int i=0 ; i<count ; i++ )
+  {
+    header.channels().insert(names[i], Channel(pixelType));
+    frameBuffer.insert(names[i], Slice(FLOAT, (char*)planes[i],
+				       sizeof(float), sizeof(float)*stride));
+  }
 
   try
   {
-    RgbaOutputFile file( fileName, width, height, WRITE_RGBA );
-    file.setFrameBuffer( tmp_img, 1, width );
-    file.writePixels( height );
+    if( tileSize>0 )
+    {
+      TiledOutputFile file( fileName, header, threads );
+      file.setFrameBuffer( frameBuffer );
+      file.writeTiles( 0, file.numXTiles()-1, 0, file.numYTiles()-1 );
+    }
+    else
+    {
+      OutputFile file( fileName, header, threads );
+      file.setFrameBuffer( frameBuffer );
+      file.writePixels( height );
+    }
   }
   catch (const std::exception &exc)
   {
     throw pfs::Exception( exc.what() );
   }
+}
+
+bool parseExrCompression( const char* name, Imf::Compression &compression )
+{
+  static const struct {
+    const char* name;
+    Imf::Compression compression;
+  } compressions[] = {
+    { "none", NO_COMPRESSION },
+    { "rle", RLE_COMPRESSION },
+    { "zips", ZIPS_COMPRESSION },
+    { "zip", ZIP_COMPRESSION },
+    { "piz", PIZ_COMPRESSION },
+    { "pxr24", PXR24_COMPRESSION },
+    { "b44", B44_COMPRESSION },
+    { "b44a", B44A_COMPRESSION },
+    { "dwaa", DWAA_COMPRESSION },
+    { "dwab", DWAB_COMPRESSION }
+  };
+
+  for( size_t i=0 ; i<sizeof(compressions)/sizeof(compressions[0]) ; i++ )
+    if( strcasecmp(name, compressions[i].name)==0 )
+    {
+      compression = compressions[i].compression;
+      return true;
+    }
+  return false;
+}
 
-  delete tmp_img;
+
+//------------------------------------------------------------------------------
+// the functions below are only for test purposes
+
+
+int test_half_conversion()
+{
+  // in range values, over range values, infinities and NaN, followed by
+  // a tail that is not a multiple of eight
+  const float values[] = { 0.0f, 1.0f, -2.5f, 0.1f, 1000.0f, 65504.0f,
+			   70000.0f, -1e9f, INFINITY, -INFINITY, NAN, 3e38f,
+			   0.5f, 65519.0f, -65520.0f, 1e-8f, 42.0f };
+  const float expected[] = { 0.0f, 1.0f, -2.5f, (float)half(0.1f), 1000.0f, HALF_MAX,
+			     HALF_MAX, -HALF_MAX, HALF_MAX, -HALF_MAX, 0.0f, HALF_MAX,
+			     0.5f, HALF_MAX, -HALF_MAX, (float)half(1e-8f), 42.0f };
+  const size_t size = sizeof(values)/sizeof(values[0]);
+
+  // every offset, so each value goes through the vector and scalar loops
+  int failures = 0;
+  for( size_t offset=0 ; offset<size ; offset++ )
+  {
+    vector<float> src(values+offset, values+size);
+    src.insert(src.end(), values, values+offset);
+    vector<half> h(size);
+    vector<float> back(size);
+    floatToHalf(&src[0], &h[0], size);
+    halfToFloat(&h[0], &back[0], size);
+    for( size_t i=0 ; i<size ; i++ )
+      if( back[i]!=expected[(i+offset)%size] )
+        failures++;
+  }
+  return failures;
 }
@@ -30,19 +30,96 @@
 
 #include <array2d.h>
 #include <ImfRgbaFile.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfInputPart.h>
+#include <ImfIO.h>
+#include <ImfCompression.h>
+#include <ImfPixelType.h>
+#include <half.h>
+
+#include <string>
+#include <vector>
 
 
 class OpenEXRReader
 {
-  Imf::RgbaInputFile* file;		/// OpenEXR file object
+public:
+  /// how pixel data is decoded
+  enum ReadMode {
+    READ_PLANAR,		/// R, G, B decoded as floats straight into the planes
+    READ_RGBA			/// decoded through an interleaved Imf::Rgba buffer
+  };
+
+private:
+  char fileName[1024];
+  Imf::IStream* stream;			/// memory mapped input, NULL when reading via stdio
+  Imf::MultiPartInputFile* file;	/// OpenEXR file object
+  Imf::InputPart* part;			/// part holding the selected layer
+  int partNumber;
+  std::string layer;			/// selected layer, empty for the default one
+  std::string channelPrefix;		/// "layer." or empty
   Imath::Box2i dw;			/// data window
+  ReadMode requestedMode;
+  ReadMode mode;
+  int threads;				/// decoding threads
+  double decodeTime;			/// seconds spent in the last readImage
   
   int width, height;
 
+  void readImageRgba( pfs::Array2D *R, pfs::Array2D *G, pfs::Array2D *B );
+  void setPlanarFrameBuffer( float *R, float *G, float *B, int firstRow );
+
 public:
-  OpenEXRReader(  const char* filename );
+  /**
+   * Opens the file and reads its header. READ_PLANAR falls back to
+   * READ_RGBA for files without R, G and B channels (e.g. luminance/chroma).
+   * threads<=0 decodes with as many threads as the OpenMP pool.
+   * If mapped is true, the file is memory mapped and the library reads
+   * (uncompressed) scanlines in place from the page cache instead of
+   * copying them with fread.
+   */
+  OpenEXRReader( const char* filename, ReadMode mode = READ_PLANAR,
+		 int threads = 0, bool mapped = false );
   ~OpenEXRReader();
 
+  /**
+   * Lists layers with R, G and B channels in all parts of the file. The
+   * default layer of an unnamed part is listed as an empty string, the
+   * default layer of a named part under the part name.
+   */
+  std::vector<std::string> getLayers() const;
+
+  /**
+   * Selects the layer (e.g. "diffuse" for diffuse.R, diffuse.G,
+   * diffuse.B) or the named part to decode. Only its part is accessed
+   * and only its channels are converted; other parts are never read.
+   * NULL or "" selects the default layer of the first part.
+   *
+   * @throws pfs::Exception if there is no such layer
+   */
+  void selectLayer( const char* layer );
+
+  ReadMode getReadMode() const
+    {
+      return mode;
+    }
+
+  int getThreads() const
+    {
+      return threads;
+    }
+
+  bool isMapped() const
+    {
+      return stream!=NULL;
+    }
+
+  /// wall-clock seconds spent decoding pixels in the last readImage call
+  double getDecodeTime() const
+    {
+      return decodeTime;
+    }
+
   int getWidth() const
     {
       return width;
@@ -54,17 +131,129 @@ public:
     }
 
   void readImage( pfs::Array2D *R, pfs::Array2D *G, pfs::Array2D *B );
+
+  /**
+   * Decodes R, G, B directly into row-major float planes of
+   * getWidth()*getHeight() elements, without any staging buffer.
+   * If Y is given, luminance (CIE Y of the pfs RGB->XYZ transform) is
+   * computed band by band while the decoded scanlines are still in cache.
+   */
+  void readImage( float *R, float *G, float *B, float *Y = NULL );
+
+  /**
+   * Same as readImage( R, G, B, Y ) but restricted to the w x h region at
+   * (x, y), given relative to the data window origin. Only the scanlines
+   * of the region are decoded; the planes hold w*h elements.
+   */
+  void readRegion( int x, int y, int w, int h,
+		   float *R, float *G, float *B, float *Y = NULL );
+
+  /**
+   * Same as above, but stores R, G, B as half. Bands of scanlines are
+   * decoded to float and converted, so Y is computed at full precision
+   * and no float copy of the whole region is held.
+   */
+  void readRegion( int x, int y, int w, int h,
+		   half *R, half *G, half *B, float *Y = NULL );
+
+  /// size of a preview read with the given subsampling factor
+  int getPreviewWidth( int factor ) const
+    {
+      return width/factor>0 ? width/factor : 1;
+    }
+
+  int getPreviewHeight( int factor ) const
+    {
+      return height/factor>0 ? height/factor : 1;
+    }
+
+  /**
+   * Reads a preview that keeps every factor-th column of every
+   * factor-th scanline (point sampling). Only the kept scanlines are
+   * requested from the library, although scanline blocks of compressed
+   * files are still decompressed as a whole. The planes hold
+   * getPreviewWidth(factor)*getPreviewHeight(factor) elements.
+   */
+  void readPreview( int factor, float *R, float *G, float *B, float *Y = NULL );
+
+  /// preview with R, G, B stored as half, Y at full precision
+  void readPreview( int factor, half *R, half *G, half *B, float *Y = NULL );
 };
 
 
 class OpenEXRWriter
 {
   char fileName[1024];
+  int threads;				/// compression threads
+  Imf::Compression compression;
+  Imf::PixelType pixelType;		/// HALF or FLOAT channels in the file
+  int tileSize;				/// 0 writes scanlines
+
+  void writePlanes( const char* const names[], const float* const planes[],
+		    int count, int width, int height, int stride );
   
 public:
-  OpenEXRWriter( const char* filename );
+  /// threads<=0 compresses with as many threads as the OpenMP pool
+  OpenEXRWriter( const char* filename, int threads = 0 );
+
+  /// NO_COMPRESSION, ZIPS_COMPRESSION, PIZ_COMPRESSION, DWAA_COMPRESSION, ...
+  void setCompression( Imf::Compression compression )
+    {
+      this->compression = compression;
+    }
+
+  /// store channels as half instead of float
+  void setHalf( bool half )
+    {
+      pixelType = half ? Imf::HALF : Imf::FLOAT;
+    }
+
+  /// write square tiles of this size, 0 writes scanlines
+  void setTileSize( int tileSize )
+    {
+      this->tileSize = tileSize;
+    }
 
   void writeImage( pfs::Array2D *R, pfs::Array2D *G, pfs::Array2D *B );
+
+  /**
+   * Writes R, G, B float planes directly through frame buffer slices.
+   * stride is the distance between rows in elements (0 means width),
+   * so a window of a larger plane can be written without copying.
+   */
+  void writeImage( const float *R, const float *G, const float *B,
+		   int width, int height, int stride = 0 );
+
+  /// writes a single luminance (Y) channel, e.g. the tone mapped L
+  void writeLuminance( const float *Y, int width, int height, int stride = 0 );
 };
 
+/**
+ * Parses none, rle, zips, zip, piz, pxr24, b44, b44a, dwaa or dwab.
+ * Returns false for unknown names.
+ */
+bool parseExrCompression( const char* name, Imf::Compression &compression );
+
+/**
+ * Resolves a requested OpenEXR thread count (<=0 means the OpenMP pool
+ * size) and makes sure the global OpenEXR thread pool is large enough.
+ */
+int setupExrThreads( int threads );
+
+/**
+ * Converts between float and half planes, eight values at a time when
+ * the F16C instructions are available. Rounds to nearest. Values beyond
+ * the half range are clamped to +-HALF_MAX and NaN becomes 0, so the
+ * colour planes stay finite.
+ */
+void floatToHalf( const float *src, half *dst, size_t size );
+void halfToFloat( const half *src, float *dst, size_t size );
+
+/**
+ * Only for test purposes: converts in range, over range and NaN values
+ * both ways and returns the number of values that differ from the
+ * expected result (0 on success).
+ */
+int test_half_conversion();
+
 #endif
@@ -0,0 +1,117 @@
+/**
+ * @brief Asynchronous read-ahead of OpenEXR images
+ */
+
+#include "exrprefetch.h"
+
+using namespace std;
+
+ExrImage::ExrImage( const string& fileName, int width, int height, bool halfPlanes ) :
+  fileName( fileName ), width( width ), height( height ),
+  roiX( 0 ), roiY( 0 ), roiWidth( width ), roiHeight( height ),
+  R( NULL ), G( NULL ), B( NULL ), frameY( NULL ),
+  halfR( NULL ), halfG( NULL ), halfB( NULL ),
+  decodeTime( 0.0 )
+{
+  if( halfPlanes )
+  {
+    halfR = new half[(size_t)width*height];
+    halfG = new half[(size_t)width*height];
+    halfB = new half[(size_t)width*height];
+  }
+  else
+  {
+    R = new pfs::Array2DImpl(width, height);
+    G = new pfs::Array2DImpl(width, height);
+    B = new pfs::Array2DImpl(width, height);
+  }
+  Y = new pfs::Array2DImpl(width, height);
+}
+
+ExrImage::~ExrImage()
+{
+  delete R;
+  delete G;
+  delete B;
+  delete Y;
+  delete frameY;
+  delete[] halfR;
+  delete[] halfG;
+  delete[] halfB;
+}
+
+ExrPrefetcher::ExrPrefetcher( const vector<string>& files, Loader loader, int depth ) :
+  files( files ), loader( loader ), depth( depth>1 ? depth : 1 ),
+  requested( 0 ), stopping( false )
+{
+  worker = thread(&ExrPrefetcher::run, this);
+}
+
+ExrPrefetcher::~ExrPrefetcher()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  notFull.notify_all();
+  worker.join();
+
+  for( size_t i=0 ; i<queue.size() ; i++ )
+    delete queue[i].image;
+}
+
+void ExrPrefetcher::run()
+{
+  for( size_t i=0 ; i<files.size() ; i++ )
+  {
+    {
+      unique_lock<mutex> lock(queueMutex);
+      while( !stopping && queue.size()>=depth )
+        notFull.wait(lock);
+      if( stopping )
+        return;
+    }
+
+    // decoding runs unlocked so the consumer can take finished images
+    Item item;
+    item.index = i;
+    item.image = NULL;
+    try
+    {
+      item.image = loader(files[i]);
+    }
+    catch( ... )
+    {
+      item.error = current_exception();
+    }
+
+    {
+      lock_guard<mutex> lock(queueMutex);
+      queue.push_back(item);
+    }
+    notEmpty.notify_one();
+  }
+}
+
+ExrImage* ExrPrefetcher::next( size_t* index )
+{
+  unique_lock<mutex> lock(queueMutex);
+  if( requested>=files.size() )
+    return NULL;
+
+  // claiming first guarantees every waiting thread an image
+  requested++;
+  while( queue.empty() )
+    notEmpty.wait(lock);
+
+  Item item = queue.front();
+  queue.pop_front();
+  lock.unlock();
+  notFull.notify_one();
+
+  if( index!=NULL )
+    *index = item.index;
+  if( item.error )
+    rethrow_exception(item.error);
+  return item.image;
+}
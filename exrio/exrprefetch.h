@@ -0,0 +1,98 @@
+/**
+ * @brief Asynchronous read-ahead of OpenEXR images
+ *
+ * Decodes the next images of a batch on a background thread while the
+ * current one is processed. Decoded images are handed over through a
+ * bounded queue, so at most 'depth' images are held ahead.
+ */
+
+#ifndef _EXR_PREFETCH_H_
+#define _EXR_PREFETCH_H_
+
+#include <array2d.h>
+#include <half.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+
+/**
+ * Decoded planes of one image. The planes cover a window of the file
+ * (the full frame, a preview or a region with its margin); the region
+ * given by roiX, roiY, roiWidth, roiHeight is the part to output.
+ * Colour is held either in the float planes R, G, B or, to halve the
+ * memory traffic, in the half planes halfR, halfG, halfB; the other set
+ * is NULL. Luminance Y is always float.
+ */
+struct ExrImage
+{
+  std::string fileName;
+  int width, height;			/// size of the planes
+  int roiX, roiY, roiWidth, roiHeight;	/// output region within the planes
+  pfs::Array2DImpl *R, *G, *B, *Y;
+  pfs::Array2DImpl *frameY;		/// whole frame luminance (preview) of a region, else NULL
+  half *halfR, *halfG, *halfB;
+  double decodeTime;			/// seconds spent decoding
+
+  ExrImage( const std::string& fileName, int width, int height, bool halfPlanes = false );
+  ~ExrImage();
+
+private:
+  ExrImage( const ExrImage& );
+  ExrImage& operator=( const ExrImage& );
+};
+
+
+class ExrPrefetcher
+{
+public:
+  /// opens and decodes one file, runs on the prefetch thread
+  typedef std::function<ExrImage*( const std::string& fileName )> Loader;
+
+private:
+  struct Item
+  {
+    size_t index;			/// position in files
+    ExrImage* image;
+    std::exception_ptr error;
+  };
+
+  std::vector<std::string> files;
+  Loader loader;
+  size_t depth;
+
+  std::deque<Item> queue;
+  size_t requested;			/// images claimed by next()
+  bool stopping;
+  std::mutex queueMutex;
+  std::condition_variable notFull, notEmpty;
+  std::thread worker;
+
+  void run();
+
+public:
+  /**
+   * Starts decoding files in order. depth is the number of decoded
+   * images kept ahead of the consumer (at least 1).
+   */
+  ExrPrefetcher( const std::vector<std::string>& files, Loader loader, int depth = 1 );
+
+  /// stops decoding and frees images that were not taken
+  ~ExrPrefetcher();
+
+  /**
+   * Returns the next image in file order, waiting for it if needed, or
+   * NULL after the last one. The caller owns the returned image.
+   * Exceptions thrown by the loader are rethrown here. Several threads
+   * may take images; index receives the position of the image in files.
+   */
+  ExrImage* next( size_t* index = NULL );
+};
+
+#endif
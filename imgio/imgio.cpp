@@ -0,0 +1,375 @@
+/**
+ * @brief Direct PNG and JPEG output of 8-bit RGB buffers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <setjmp.h>
+#include <assert.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <png.h>
+#include <zlib.h>
+#include <jpeglib.h>
+#include <omp.h>
+
+#include <pfs.h>
+#include "imgio.h"
+
+using namespace std;
+
+
+RgbImageWriter::RgbImageWriter( const char* filename ) :
+  pngLevel( 7 ), pngFilters( PNG_ALL_FILTERS ), pngBands( 1 ), threads( 0 ), jpegQuality( 92 )
+{
+  strncpy(fileName, filename, sizeof(fileName)-1);
+  fileName[sizeof(fileName)-1] = 0;
+  format = formatOf(filename);
+}
+
+RgbImageWriter::Format RgbImageWriter::formatOf( const char* filename )
+{
+  const char* ext = strrchr(filename, '.');
+  if( ext==NULL )
+    return FORMAT_UNKNOWN;
+  if( strcasecmp(ext, ".png")==0 )
+    return FORMAT_PNG;
+  if( strcasecmp(ext, ".jpg")==0 || strcasecmp(ext, ".jpeg")==0 )
+    return FORMAT_JPEG;
+  return FORMAT_UNKNOWN;
+}
+
+void RgbImageWriter::writeImage( const unsigned char *rgb, int width, int height )
+{
+  switch( format )
+  {
+  case FORMAT_PNG:
+    if( pngBands>1 && height>1 )
+      writePngBands(rgb, width, height);
+    else
+      writePng(rgb, width, height);
+    break;
+  case FORMAT_JPEG:
+    writeJpeg(rgb, width, height);
+    break;
+  default:
+    throw pfs::Exception("unsupported output format");
+  }
+}
+
+void RgbImageWriter::writePng( const unsigned char *rgb, int width, int height )
+{
+  FILE *fp = fopen(fileName, "wb");
+  if( fp==NULL )
+    throw pfs::Exception("PNG: cannot open file for writing");
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png==NULL ? NULL : png_create_info_struct(png);
+  if( info==NULL )
+  {
+    png_destroy_write_struct(&png, NULL);
+    fclose(fp);
+    throw pfs::Exception("PNG: out of memory");
+  }
+
+  if( setjmp(png_jmpbuf(png)) )
+  {
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    throw pfs::Exception("PNG: error while writing");
+  }
+
+  png_init_io(png, fp);
+  png_set_compression_level(png, pngLevel);
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, pngFilters);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+	       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_write_info(png, info);
+  for( int y=0 ; y<height ; y++ )
+    png_write_row(png, (png_const_bytep)(rgb + (size_t)y*width*3));
+  png_write_end(png, info);
+
+  png_destroy_write_struct(&png, &info);
+  if( fclose(fp)!=0 )
+    throw pfs::Exception("PNG: error while writing");
+}
+
+//--------------------------------------------------------------------
+// PNG with parallel deflate
+
+static inline int paethPredictor( int a, int b, int c )
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if( pa<=pb && pa<=pc )
+    return a;
+  return pb<=pc ? b : c;
+}
+
+/**
+ * Applies PNG filter type to one row of n bytes with bpp bytes per pixel.
+ * prev is the unfiltered previous row (zeros for the first one). Returns
+ * the sum of the filtered bytes taken as signed, the libpng heuristic for
+ * choosing a filter.
+ */
+static unsigned filterRow( int type, const unsigned char *row, const unsigned char *prev,
+			   unsigned char *out, int n, int bpp )
+{
+  unsigned sum = 0;
+  for( int i=0 ; i<n ; i++ )
+  {
+    int a = i>=bpp ? row[i-bpp] : 0;
+    int b = prev[i];
+    int c = i>=bpp ? prev[i-bpp] : 0;
+    int predicted = 0;
+    switch( type )
+    {
+    case 1: predicted = a; break;
+    case 2: predicted = b; break;
+    case 3: predicted = (a + b) >> 1; break;
+    case 4: predicted = paethPredictor(a, b, c); break;
+    }
+    unsigned char v = (unsigned char)(row[i] - predicted);
+    out[i] = v;
+    sum += v<128 ? v : 256-v;
+  }
+  return sum;
+}
+
+static void writeChunk( FILE *fp, const char *type, const unsigned char *data, size_t size )
+{
+  unsigned char header[8] = {
+    (unsigned char)(size>>24), (unsigned char)(size>>16),
+    (unsigned char)(size>>8), (unsigned char)size,
+    (unsigned char)type[0], (unsigned char)type[1],
+    (unsigned char)type[2], (unsigned char)type[3] };
+  uLong crc = crc32(0L, header+4, 4);
+  if( size>0 )
+    crc = crc32(crc, data, size);
+  unsigned char footer[4] = {
+    (unsigned char)(crc>>24), (unsigned char)(crc>>16),
+    (unsigned char)(crc>>8), (unsigned char)crc };
+
+  fwrite(header, 1, 8, fp);
+  if( size>0 )
+    fwrite(data, 1, size, fp);
+  fwrite(footer, 1, 4, fp);
+}
+
+void RgbImageWriter::writePngBands( const unsigned char *rgb, int width, int height )
+{
+  static const int filterBits[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+				     PNG_FILTER_AVG, PNG_FILTER_PAETH };
+  const int bpp = 3;
+  const size_t rowBytes = (size_t)width * bpp;
+  const size_t lineBytes = rowBytes + 1;	// filter type + filtered row
+  const int bands = min(pngBands, height);
+  const int team = threads>0 ? threads : omp_get_max_threads();
+
+  // filtering only looks at the unfiltered previous row, so rows are
+  // independent
+  vector<unsigned char> filtered( lineBytes * height );
+  vector<unsigned char> zeros( rowBytes, 0 );
+  #pragma omp parallel num_threads(team)
+  {
+    vector<unsigned char> candidate( rowBytes );
+
+    #pragma omp for schedule(static)
+    for( int y=0 ; y<height ; y++ )
+    {
+      const unsigned char *row = rgb + (size_t)y*rowBytes;
+      const unsigned char *prev = y>0 ? row - rowBytes : &zeros[0];
+      unsigned char *line = &filtered[(size_t)y*lineBytes];
+
+      unsigned best = ~0u;
+      for( int type=0 ; type<5 ; type++ )
+      {
+        if( !(pngFilters & filterBits[type]) )
+          continue;
+        unsigned sum = filterRow(type, row, prev, &candidate[0], (int)rowBytes, bpp);
+        if( sum<best )
+        {
+          best = sum;
+          line[0] = (unsigned char)type;
+          memcpy(line+1, &candidate[0], rowBytes);
+        }
+      }
+      if( best==~0u )			// empty mask, store unfiltered
+      {
+        line[0] = 0;
+        memcpy(line+1, row, rowBytes);
+      }
+    }
+  }
+
+  // each band is a raw deflate stream ending on a byte boundary (full
+  // flush) and the last one is finished, so their concatenation is one
+  // stream; the adler32 checksums are combined
+  vector< vector<unsigned char> > packed( bands );
+  vector<uLong> adler( bands );
+  vector<size_t> bandSize( bands );
+  bool failed = false;
+
+  #pragma omp parallel for schedule(dynamic) num_threads(team)
+  for( int band=0 ; band<bands ; band++ )
+  {
+    int y0 = (int)((long long)height * band / bands);
+    int y1 = (int)((long long)height * (band+1) / bands);
+    unsigned char *in = &filtered[(size_t)y0*lineBytes];
+    size_t inSize = (size_t)(y1-y0)*lineBytes;
+    bandSize[band] = inSize;
+    adler[band] = adler32(adler32(0L, Z_NULL, 0), in, inSize);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if( deflateInit2(&zs, pngLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK )
+    {
+      failed = true;
+      continue;
+    }
+
+    vector<unsigned char> &out = packed[band];
+    out.resize(deflateBound(&zs, inSize) + 16);
+    zs.next_in = in;
+    zs.avail_in = inSize;
+    zs.next_out = &out[0];
+    zs.avail_out = out.size();
+    int flush = band==bands-1 ? Z_FINISH : Z_FULL_FLUSH;
+    int ret = deflate(&zs, flush);
+    if( (flush==Z_FINISH && ret!=Z_STREAM_END) || (flush!=Z_FINISH && (ret!=Z_OK || zs.avail_out==0)) )
+      failed = true;
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+  }
+  if( failed )
+    throw pfs::Exception("PNG: deflate failed");
+
+  uLong checksum = adler[0];
+  size_t idatSize = 2 + 4;
+  for( int band=0 ; band<bands ; band++ )
+  {
+    if( band>0 )
+      checksum = adler32_combine(checksum, adler[band], bandSize[band]);
+    idatSize += packed[band].size();
+  }
+
+  vector<unsigned char> idat;
+  idat.reserve(idatSize);
+  // zlib header: deflate with a 32K window and the level hint
+  int levelHint = pngLevel<2 ? 0 : pngLevel<6 ? 1 : pngLevel==6 ? 2 : 3;
+  int cmf = 0x78, flg = levelHint<<6;
+  flg += 31 - (cmf*256 + flg) % 31;
+  idat.push_back((unsigned char)cmf);
+  idat.push_back((unsigned char)flg);
+  for( int band=0 ; band<bands ; band++ )
+    idat.insert(idat.end(), packed[band].begin(), packed[band].end());
+  idat.push_back((unsigned char)(checksum>>24));
+  idat.push_back((unsigned char)(checksum>>16));
+  idat.push_back((unsigned char)(checksum>>8));
+  idat.push_back((unsigned char)checksum);
+
+  FILE *fp = fopen(fileName, "wb");
+  if( fp==NULL )
+    throw pfs::Exception("PNG: cannot open file for writing");
+
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  unsigned char ihdr[13] = {
+    (unsigned char)(width>>24), (unsigned char)(width>>16),
+    (unsigned char)(width>>8), (unsigned char)width,
+    (unsigned char)(height>>24), (unsigned char)(height>>16),
+    (unsigned char)(height>>8), (unsigned char)height,
+    8, PNG_COLOR_TYPE_RGB, 0, 0, 0 };
+  fwrite(signature, 1, 8, fp);
+  writeChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+  writeChunk(fp, "IDAT", &idat[0], idat.size());
+  writeChunk(fp, "IEND", NULL, 0);
+
+  bool error = ferror(fp)!=0;
+  if( fclose(fp)!=0 || error )
+    throw pfs::Exception("PNG: error while writing");
+}
+
+//--------------------------------------------------------------------
+// JPEG
+
+struct JpegError
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void jpegErrorExit( j_common_ptr cinfo )
+{
+  longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+void RgbImageWriter::writeJpeg( const unsigned char *rgb, int width, int height )
+{
+  FILE *fp = fopen(fileName, "wb");
+  if( fp==NULL )
+    throw pfs::Exception("JPEG: cannot open file for writing");
+
+  struct jpeg_compress_struct cinfo;
+  JpegError jerr;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpegErrorExit;
+  if( setjmp(jerr.jump) )
+  {
+    jpeg_destroy_compress(&cinfo);
+    fclose(fp);
+    throw pfs::Exception("JPEG: error while writing");
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, fp);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, jpegQuality, TRUE);
+
+  // like ImageMagick, high qualities keep full chroma resolution
+  if( jpegQuality>=90 )
+    for( int i=0 ; i<cinfo.num_components ; i++ )
+      cinfo.comp_info[i].h_samp_factor = cinfo.comp_info[i].v_samp_factor = 1;
+
+  jpeg_start_compress(&cinfo, TRUE);
+  while( cinfo.next_scanline<cinfo.image_height )
+  {
+    JSAMPROW row = (JSAMPROW)(rgb + (size_t)cinfo.next_scanline*width*3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  if( fclose(fp)!=0 )
+    throw pfs::Exception("JPEG: error while writing");
+}
+
+bool parsePngFilter( const char* name, int &filters )
+{
+  static const struct {
+    const char* name;
+    int filters;
+  } names[] = {
+    { "none", PNG_FILTER_NONE },
+    { "sub", PNG_FILTER_SUB },
+    { "up", PNG_FILTER_UP },
+    { "avg", PNG_FILTER_AVG },
+    { "paeth", PNG_FILTER_PAETH },
+    { "all", PNG_ALL_FILTERS }
+  };
+
+  for( size_t i=0 ; i<sizeof(names)/sizeof(names[0]) ; i++ )
+    if( strcasecmp(name, names[i].name)==0 )
+    {
+      filters = names[i].filters;
+      return true;
+    }
+  return false;
+}
@@ -0,0 +1,95 @@
+/**
+ * @brief Direct PNG and JPEG output of 8-bit RGB buffers
+ *
+ * Encodes interleaved 8-bit RGB with libpng and libjpeg, without going
+ * through an intermediate image object. PNG data can be deflated in
+ * independent row bands on several threads.
+ */
+
+#ifndef _IMG_IO_H_
+#define _IMG_IO_H_
+
+#include <png.h>
+
+
+class RgbImageWriter
+{
+public:
+  enum Format {
+    FORMAT_PNG,
+    FORMAT_JPEG,
+    FORMAT_UNKNOWN			/// not handled here
+  };
+
+private:
+  char fileName[1024];
+  Format format;
+  int pngLevel;				/// zlib level 0-9
+  int pngFilters;			/// PNG_FILTER_* mask
+  int pngBands;				/// row bands deflated in parallel, <=1 uses libpng
+  int threads;				/// OpenMP threads of the band encoder
+  int jpegQuality;
+
+  void writePng( const unsigned char *rgb, int width, int height );
+  void writePngBands( const unsigned char *rgb, int width, int height );
+  void writeJpeg( const unsigned char *rgb, int width, int height );
+
+public:
+  /// the format is chosen by the file name extension
+  RgbImageWriter( const char* filename );
+
+  static Format formatOf( const char* filename );
+
+  Format getFormat() const
+    {
+      return format;
+    }
+
+  /// zlib compression level 0-9
+  void setPngLevel( int level )
+    {
+      pngLevel = level;
+    }
+
+  /// PNG_FILTER_NONE, PNG_FILTER_SUB, ... or PNG_ALL_FILTERS
+  void setPngFilters( int filters )
+    {
+      pngFilters = filters;
+    }
+
+  /**
+   * Deflates the image in this many bands of rows in parallel. Each band
+   * ends with a full flush, so the result is a single valid zlib stream
+   * that is slightly larger than a serial one.
+   */
+  void setPngBands( int bands )
+    {
+      pngBands = bands;
+    }
+
+  /// OpenMP threads used for the row bands, 0 uses the OpenMP default
+  void setThreads( int n )
+    {
+      threads = n;
+    }
+
+  void setJpegQuality( int quality )
+    {
+      jpegQuality = quality;
+    }
+
+  /**
+   * Writes width*height interleaved R, G, B bytes.
+   *
+   * @throws pfs::Exception on unknown formats and encoder errors
+   */
+  void writeImage( const unsigned char *rgb, int width, int height );
+};
+
+/**
+ * Parses none, sub, up, avg, paeth or all into a PNG_FILTER_* mask.
+ * Returns false for unknown names.
+ */
+bool parsePngFilter( const char* name, int &filters );
+
+#endif
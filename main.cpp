@@ -1,233 +1,1066 @@
 #include <iostream>
-#include <array>
+#include <future>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <omp.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <getopt.h>
 #include <Magick++.h>
 #include <sys/time.h>
 #include <boost/format.hpp>
 
 #include "pfs.h"
 #include "exrio.h"
+#include "exrprefetch.h"
+#include "imgio.h"
+#include "pipeline.h"
 #include "tmo_fattal02.h"
+#include "pde.h"
 
 using namespace std;
 using namespace boost;
 using namespace Magick;
 
-typedef array<float, 3> vec3f;
-
-vec3f simpleTonemapping(const vec3f& color);
-vec3f rgb2Yxy(vec3f rgb);
-vec3f Yxy2rgb(vec3f Yxy);
+// scalar in and out so the per-pixel loop vectorises
+void simpleTonemapping(float r, float g, float b, float& outR, float& outG, float& outB);
+void rgb2Yxy(float r, float g, float b, float& Y, float& x, float& y);
+void Yxy2rgb(float Y, float x, float y, float& r, float& g, float& b);
 
 template<class T>
 T clamp(const T v, const T minV, const T maxV);
 
+void postProcessRow(const float* r, const float* g, const float* b, const float* y, const float* l,
+					int width, float lRatio, unsigned char* map, unsigned char* simple, unsigned char* fusion);
+
 struct timeval tpstart, tpend;
 void logTime(const string& message);
+void printHelp(const char* prog);
+
+struct Options {
+	float alpha = 1.0f;
+	float beta = 0.9f;
+	float gamma = 0.8f;
+	//float saturation = 1.0f;
+	float noise = 0.02f;
+	int   detail_level = 3;
+	float black_point = 0.1f;
+	float white_point = 0.5f;
+	bool  fftsolver = true;
+	bool  fft_float = false;	// single precision Poisson solve
+	PdeFftPlanning fft_plan = PDE_FFT_ESTIMATE;
+	const char* fft_wisdom = NULL;
+	OpenEXRReader::ReadMode read_mode = OpenEXRReader::READ_PLANAR;
+	int   exr_threads = 0;
+	bool  mmap = false;
+	int   roi[4] = {0, 0, 0, 0};	// x, y, width, height; width 0 = full frame
+	int   roi_margin = -1;		// -1 = derived from the pyramid depth
+	const char* hdr_out = NULL;	// may contain %1% for the image number
+	Imf::Compression exr_compression = Imf::ZIP_COMPRESSION;
+	bool  exr_float = false;
+	int   exr_tile = 0;
+	const char* layer = NULL;
+	int   preview = 1;
+	int   prefetch = 1;		// images decoded ahead, 0 = no read-ahead
+	bool  half_planes = false;	// keep R, G, B as half
+	int   png_level = 7;
+	int   png_filters = PNG_ALL_FILTERS;
+	int   png_bands = 1;		// rows bands deflated in parallel
+	int   jobs = 1;			// images processed concurrently
+	bool  pipeline = false;		// overlap the stages of consecutive images
+	int   stage_threads[4] = {0, 0, 0, 0};	// decode, tonemap, post, encode; 0 = default
+};
+
+// one image and its three outputs
+struct Job {
+	string exrFile, mapFile, simpleFile, fusionFile;
+};
+
+void readManifest(const char* fileName, vector<Job>& jobs);
+vector<string> runJobs(const vector<Job>& jobs, const Options& opt);
+void runPipeline(const vector<Job>& jobs, const Options& opt);
+bool serveRequest(const string& line, const Options& defaults, string& reply);
+void serve(const char* socketPath, const Options& opt);
+
+ExrImage* loadImage(const string& exrFile, const Options& opt);
+
+// state of one image between the processing stages
+struct Frame {
+	ExrImage* image = NULL;
+	pfs::Array2DImpl* L = NULL;
+	float lMean = -1;			// whole frame mean of L for a region, else < 0
+	unsigned char* mapBuffer = NULL;
+	unsigned char* simpleBuffer = NULL;
+	unsigned char* fusionBuffer = NULL;
+
+	Frame() {}
+	Frame(const Frame&) = delete;
+	Frame& operator=(const Frame&) = delete;
+	~Frame() {
+		clear();
+	}
+
+	void clear() {
+		delete image;
+		delete L;
+		delete[] mapBuffer;
+		delete[] simpleBuffer;
+		delete[] fusionBuffer;
+		image = NULL;
+		L = NULL;
+		lMean = -1;
+		mapBuffer = simpleBuffer = fusionBuffer = NULL;
+	}
+};
+
+void toneMap(Frame& frame, int index, const Options& opt);
+float meanL(const float* L, int width, int height, int stride);
+void postProcess(Frame& frame);
+void encode(Frame& frame, const Job& job, const Options& opt, int threads);
+void writeOutput(const char* fileName, const unsigned char* buffer, int width, int height,
+				 int quality, int threads, const Options& opt);
 
 int main(int argc, char* argv[]) {
 	gettimeofday(&tpstart, NULL);
 
-	float opt_alpha = 1.0f;
-	float opt_beta = 0.9f;
-	float opt_gamma = 0.8f;
-	//float opt_saturation = 1.0f;
-	float opt_noise = 0.02f;
-	int   opt_detail_level = 3;
-	float opt_black_point = 0.1f;
-	float opt_white_point = 0.5f;
-	bool  opt_fftsolver = true;
-
-	if (argc != 5) {
-		cout << format("Usage: %1% <exr image> <map image> <simple image> <fusion image>") % argv[0] << endl;
+	Options opt;
+	bool opt_list_layers = false;
+	const char* opt_batch = NULL;
+	const char* opt_serve = NULL;
+
+	static struct option cmdLineOptions[] = {
+		{ "rgba-read", no_argument, NULL, 'r' },
+		{ "exr-threads", required_argument, NULL, 't' },
+		{ "mmap", no_argument, NULL, 'm' },
+		{ "roi", required_argument, NULL, 'c' },
+		{ "roi-margin", required_argument, NULL, 'M' },
+		{ "hdr-out", required_argument, NULL, 'o' },
+		{ "exr-compression", required_argument, NULL, 'z' },
+		{ "exr-float", no_argument, NULL, 'f' },
+		{ "exr-tile", required_argument, NULL, 'T' },
+		{ "layer", required_argument, NULL, 'l' },
+		{ "list-layers", no_argument, NULL, 'L' },
+		{ "preview", required_argument, NULL, 'p' },
+		{ "prefetch", required_argument, NULL, 'P' },
+		{ "half-planes", no_argument, NULL, 'H' },
+		{ "fft-float", no_argument, NULL, 'e' },
+		{ "fft-plan", required_argument, NULL, 'k' },
+		{ "fft-wisdom", required_argument, NULL, 'w' },
+		{ "png-level", required_argument, NULL, 'Z' },
+		{ "png-filter", required_argument, NULL, 'F' },
+		{ "png-bands", required_argument, NULL, 'B' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "pipeline", no_argument, NULL, 'S' },
+		{ "serve", required_argument, NULL, 'd' },
+		{ "stage-threads", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int optionIndex = 0;
+	while (true) {
+		int c = getopt_long(argc, argv, "rt:mc:M:o:z:fT:l:Lp:P:Hek:w:Z:F:B:b:j:Ss:d:h", cmdLineOptions, &optionIndex);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'r':
+			opt.read_mode = OpenEXRReader::READ_RGBA;
+			break;
+		case 't':
+			opt.exr_threads = atoi(optarg);
+			break;
+		case 'm':
+			opt.mmap = true;
+			break;
+		case 'c':
+			if (sscanf(optarg, "%d,%d,%d,%d", &opt.roi[0], &opt.roi[1], &opt.roi[2], &opt.roi[3]) != 4 ||
+				opt.roi[2] <= 0 || opt.roi[3] <= 0) {
+				cout << "--roi expects x,y,width,height" << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			opt.roi_margin = atoi(optarg);
+			break;
+		case 'o':
+			opt.hdr_out = optarg;
+			break;
+		case 'z':
+			if (!parseExrCompression(optarg, opt.exr_compression)) {
+				cout << format("unknown exr compression: %1%") % optarg << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			opt.exr_float = true;
+			break;
+		case 'T':
+			opt.exr_tile = atoi(optarg);
+			break;
+		case 'l':
+			opt.layer = optarg;
+			break;
+		case 'L':
+			opt_list_layers = true;
+			break;
+		case 'p':
+			opt.preview = atoi(optarg);
+			if (opt.preview < 1) {
+				cout << "--preview expects a factor >= 1" << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			opt.prefetch = atoi(optarg);
+			break;
+		case 'H':
+			opt.half_planes = true;
+			break;
+		case 'e':
+			opt.fft_float = true;
+			break;
+		case 'k':
+			if (strcmp(optarg, "estimate") == 0) {
+				opt.fft_plan = PDE_FFT_ESTIMATE;
+			} else if (strcmp(optarg, "measure") == 0) {
+				opt.fft_plan = PDE_FFT_MEASURE;
+			} else if (strcmp(optarg, "patient") == 0) {
+				opt.fft_plan = PDE_FFT_PATIENT;
+			} else {
+				cout << "--fft-plan expects estimate, measure or patient" << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			opt.fft_wisdom = optarg;
+			break;
+		case 'Z':
+			opt.png_level = atoi(optarg);
+			if (opt.png_level < 0 || opt.png_level > 9) {
+				cout << "--png-level expects 0-9" << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			if (!parsePngFilter(optarg, opt.png_filters)) {
+				cout << format("unknown png filter: %1%") % optarg << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'B':
+			opt.png_bands = atoi(optarg);
+			break;
+		case 'b':
+			opt_batch = optarg;
+			break;
+		case 'j':
+			opt.jobs = atoi(optarg);
+			if (opt.jobs < 1) {
+				cout << "--jobs expects a count >= 1" << endl;
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			opt.pipeline = true;
+			break;
+		case 'd':
+			opt_serve = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d,%d,%d,%d", &opt.stage_threads[0], &opt.stage_threads[1],
+					   &opt.stage_threads[2], &opt.stage_threads[3]) != 4) {
+				cout << "--stage-threads expects decode,tonemap,post,encode" << endl;
+				return EXIT_FAILURE;
+			}
+			opt.pipeline = true;
+			break;
+		case 'h':
+			printHelp(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			printHelp(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opt.preview > 1 && opt.roi[2] > 0) {
+		cout << "--preview and --roi cannot be combined" << endl;
 		return EXIT_FAILURE;
 	}
 
-	logTime("program inited");
+	try {
+		if (opt_list_layers) {
+			if (argc - optind != 1) {
+				printHelp(argv[0]);
+				return EXIT_FAILURE;
+			}
+			OpenEXRReader reader(argv[optind], opt.read_mode, opt.exr_threads, opt.mmap);
+			vector<string> layers = reader.getLayers();
+			for (size_t i = 0; i < layers.size(); i++) {
+				cout << (layers[i].empty() ? "(default)" : layers[i]) << endl;
+			}
+			return EXIT_SUCCESS;
+		}
 
-	OpenEXRReader reader(argv[1]);
+		pde_fft_set_planning(opt.fft_plan, opt.fft_wisdom);
 
-	logTime("image opened");
+		if (opt_serve != NULL) {
+			if (argc - optind != 0) {
+				printHelp(argv[0]);
+				return EXIT_FAILURE;
+			}
+			serve(opt_serve, opt);
+			return EXIT_SUCCESS;
+		}
 
-	int w = reader.getWidth();
-	int h = reader.getHeight();
-	int pixelCount = w * h;
-	int valueCount = pixelCount * 3;
-	float maxValue8 = (float)(1<<8) - 1;
-	float maxValue16 = (float)(1<<16) - 1;
+		vector<Job> jobs;
+		if (opt_batch != NULL) {
+			if (argc - optind != 0) {
+				printHelp(argv[0]);
+				return EXIT_FAILURE;
+			}
+			readManifest(opt_batch, jobs);
+		} else {
+			if (argc - optind == 0 || (argc - optind) % 4 != 0) {
+				printHelp(argv[0]);
+				return EXIT_FAILURE;
+			}
+			for (int i = optind; i < argc; i += 4) {
+				Job job = {argv[i], argv[i + 1], argv[i + 2], argv[i + 3]};
+				jobs.push_back(job);
+			}
+		}
+
+		logTime("program inited");
+
+		if (opt.pipeline) {
+			runPipeline(jobs, opt);
+		} else {
+			vector<string> errors = runJobs(jobs, opt);
+			size_t failures = jobs.size() - count(errors.begin(), errors.end(), string());
+			if (failures > 0) {
+				cout << format("error: %1% of %2% images failed") % failures % jobs.size() << endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	catch (pfs::Exception& ex) {
+		cout << format("error: %1%") % ex.getMessage() << endl;
+		return EXIT_FAILURE;
+	}
+	catch (std::exception& ex) {
+		cout << format("error: %1%") % ex.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// manifest lines hold "<exr> <map> <simple> <fusion>", blank lines and
+// lines starting with # are skipped; "-" reads the manifest from stdin
+void readManifest(const char* fileName, vector<Job>& jobs) {
+	ifstream file;
+	if (strcmp(fileName, "-") != 0) {
+		file.open(fileName);
+		if (!file) {
+			throw pfs::Exception(str(format("cannot open manifest %1%") % fileName).c_str());
+		}
+	}
+	istream& in = file.is_open() ? file : cin;
 
-	logTime("constant done");
+	string line;
+	for (int lineNumber = 1; getline(in, line); lineNumber++) {
+		istringstream fields(line);
+		Job job;
+		if (!(fields >> job.exrFile) || job.exrFile[0] == '#') {
+			continue;
+		}
+		string extra;
+		if (!(fields >> job.mapFile >> job.simpleFile >> job.fusionFile) || (fields >> extra)) {
+			throw pfs::Exception(str(format("%1%:%2%: expected <exr> <map> <simple> <fusion>") % fileName % lineNumber).c_str());
+		}
+		jobs.push_back(job);
+	}
+}
+
+// images are processed by up to opt.jobs threads, each with an equal
+// share of the OpenMP threads; decoding runs ahead on the prefetch thread.
+// A failing image does not stop the others, the returned messages are
+// empty for the images that were written
+vector<string> runJobs(const vector<Job>& jobs, const Options& opt) {
+	vector<string> errors(jobs.size());
+	if (jobs.empty()) {
+		return errors;
+	}
 
-	pfs::Array2DImpl* __R = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* __G = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* __B = new pfs::Array2DImpl(w, h);
+	vector<string> exrFiles;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		exrFiles.push_back(jobs[i].exrFile);
+	}
 
-	pfs::Array2DImpl* X = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* Y = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* Z = new pfs::Array2DImpl(w, h);
+	int workers = min(opt.jobs, (int)jobs.size());
+	int threads = max(omp_get_max_threads() / workers, 1);
 
-	pfs::Array2DImpl* _R = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* _G = new pfs::Array2DImpl(w, h);
-	pfs::Array2DImpl* _B = new pfs::Array2DImpl(w, h);
+	// threads started here, the prefetcher and the encoders, do not
+	// inherit the share and are given it explicitly
+	ExrPrefetcher* prefetcher = NULL;
+	if (opt.prefetch > 0) {
+		prefetcher = new ExrPrefetcher(exrFiles, [&opt, threads](const string& exrFile) {
+			omp_set_num_threads(threads);
+			return loadImage(exrFile, opt);
+		}, max(opt.prefetch, opt.jobs));
+	}
 
-	logTime("memory alloc");
+	atomic<size_t> nextJob(0);
 
-	reader.readImage(__R, __G, __B);
+	auto worker = [&]() {
+		omp_set_num_threads(threads);
+		while (true) {
+			// the prefetcher sets i before rethrowing a decoding error
+			size_t i = 0;
+			try {
+				ExrImage* image = NULL;
+				if (prefetcher != NULL) {
+					image = prefetcher->next(&i);
+				} else if ((i = nextJob++) < jobs.size()) {
+					image = loadImage(jobs[i].exrFile, opt);
+				}
+				if (image == NULL) {
+					break;
+				}
 
-	logTime("image read");
+				logTime(str(format("image %1%/%2% ready") % (i + 1) % jobs.size()));
 
-	memcpy(_R->getRawData(), __R->getRawData(), sizeof(float) * pixelCount);
-	memcpy(_G->getRawData(), __G->getRawData(), sizeof(float) * pixelCount);
-	memcpy(_B->getRawData(), __B->getRawData(), sizeof(float) * pixelCount);
+				Frame frame;
+				frame.image = image;
+				toneMap(frame, i, opt);
+				postProcess(frame);
+				encode(frame, jobs[i], opt, threads);
+			}
+			catch (pfs::Exception& ex) {
+				errors[i] = ex.getMessage();
+			}
+			catch (std::exception& ex) {
+				errors[i] = ex.what();
+			}
+			catch (...) {
+				errors[i] = "unknown error";
+			}
+			if (!errors[i].empty()) {
+				cout << format("error: %1%: %2%") % jobs[i].exrFile % errors[i] << endl;
+			}
+		}
+	};
 
-	logTime("memory copy");
+	if (workers == 1) {
+		worker();
+	} else {
+		vector<thread> pool;
+		for (int i = 0; i < workers; i++) {
+			pool.push_back(thread(worker));
+		}
+		for (int i = 0; i < workers; i++) {
+			pool[i].join();
+		}
+	}
 
-	pfs::transformColorSpace(pfs::CS_RGB, __R, __G, __B, pfs::CS_XYZ, X, Y, Z);
+	delete prefetcher;
 
-	if(Y == NULL || X == NULL || Z == NULL) {
-		throw pfs::Exception( "Missing X, Y, Z channels in the PFS stream" );
+	return errors;
+}
+
+// decode (with luminance), tone mapping, post-processing and encoding
+// run on their own threads, so consecutive images overlap; images wait
+// between stages in queues of opt.prefetch entries
+void runPipeline(const vector<Job>& jobs, const Options& opt) {
+	int cores = omp_get_max_threads();
+	int defaults[4] = {max(cores / 4, 1), cores, max(cores / 4, 1), max(cores / 4, 1)};
+	int threads[4];
+	for (int s = 0; s < 4; s++) {
+		threads[s] = opt.stage_threads[s] > 0 ? opt.stage_threads[s] : defaults[s];
 	}
 
-	// tone mapping
-	pfs::Array2DImpl* L = new pfs::Array2DImpl(w, h);
-	tmo_fattal02(w, h, Y->getRawData(), L->getRawData(), opt_alpha, opt_beta,
-					opt_gamma, opt_noise, opt_detail_level,
-					opt_black_point, opt_white_point, opt_fftsolver);
+	vector<Frame> frames(jobs.size());
+	StagePipeline<Frame> pipeline;
+	pipeline.addStage("decode", threads[0], [&](Frame& frame, size_t i) {
+		frame.image = loadImage(jobs[i].exrFile, opt);
+		logTime(str(format("image %1%/%2% decoded") % (i + 1) % jobs.size()));
+	});
+	pipeline.addStage("tonemap", threads[1], [&](Frame& frame, size_t i) {
+		toneMap(frame, i, opt);
+	});
+	pipeline.addStage("post", threads[2], [&](Frame& frame, size_t i) {
+		postProcess(frame);
+	});
+	pipeline.addStage("encode", threads[3], [&](Frame& frame, size_t i) {
+		encode(frame, jobs[i], opt, threads[3]);
+		frame.clear();
+	});
 
-	logTime("tone mapped");
+	pipeline.run(frames, max(opt.prefetch, 1));
+	pipeline.printOccupancy(cout);
+}
 
-	// in-place color space transform
-	pfs::Array2DImpl *G = new pfs::Array2DImpl(w, h); // copy for G to preserve Y
-	pfs::Array2D *R = X, *B = Z;
+// a request is one line "<exr> <map> <simple> <fusion> [name=value ...]"
+// with name one of alpha, beta, gamma, noise, black, white or preview;
+// the reply is "ok <seconds>" or "error <message>". Returns false for
+// "quit".
+bool serveRequest(const string& line, const Options& defaults, string& reply) {
+	istringstream fields(line);
+	Job job;
+	reply.clear();
+	if (!(fields >> job.exrFile) || job.exrFile[0] == '#') {
+		return true;
+	}
+	if (job.exrFile == "quit") {
+		return false;
+	}
+	if (!(fields >> job.mapFile >> job.simpleFile >> job.fusionFile)) {
+		reply = "error expected <exr> <map> <simple> <fusion> [name=value ...]";
+		return true;
+	}
 
-	pfs::transformColorSpace(pfs::CS_XYZ, X, Y, Z, pfs::CS_RGB, R, G, B);
-		
-	// Color correction
-	float lSum = 0;
-	for (int i = 0; i < pixelCount; i++) {
-		static const float epsilon = 1e-4f;
-		lSum += max((*L)(i), epsilon);
+	Options opt = defaults;
+	string param;
+	while (fields >> param) {
+		size_t eq = param.find('=');
+		string name = param.substr(0, eq);
+		const char* value = eq == string::npos ? "" : param.c_str() + eq + 1;
+		char* end;
+		float number = strtof(value, &end);
+		if (*value == 0 || *end != 0) {
+			reply = str(format("error bad parameter %1%") % param);
+			return true;
+		}
+
+		if (name == "alpha") {
+			opt.alpha = number;
+		} else if (name == "beta") {
+			opt.beta = number;
+		} else if (name == "gamma") {
+			opt.gamma = number;
+		} else if (name == "noise") {
+			opt.noise = number;
+		} else if (name == "black") {
+			opt.black_point = number;
+		} else if (name == "white") {
+			opt.white_point = number;
+		} else if (name == "preview" && number >= 1) {
+			opt.preview = (int)number;
+		} else {
+			reply = str(format("error bad parameter %1%") % param);
+			return true;
+		}
 	}
-	float lMean = lSum / pixelCount;
-	float lRatio = 1;
-	if (lMean < (155.0 / 255)) {
-		lRatio = (155.0 / 255) / lMean;
+	if (opt.preview > 1 && opt.roi[2] > 0) {
+		reply = "error preview and --roi cannot be combined";
+		return true;
 	}
-	cout << "lRatio: " << lRatio << endl;
 
-	for (int i = 0; i < pixelCount; i++) {
-		static const float epsilon = 1e-4f;
-		float y = max((*Y)(i), epsilon);
-		float l = min(max((*L)(i), epsilon) * lRatio, 1.0f);
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	vector<string> errors = runJobs(vector<Job>(1, job), opt);
+	if (!errors[0].empty()) {
+		reply = str(format("error %1%") % errors[0]);
+		return true;
+	}
+	gettimeofday(&end, NULL);
+
+	double latency = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	reply = str(format("ok %1%") % latency);
+	return true;
+}
+
+// resident tone mapper: requests are read from a Unix domain socket, or
+// from stdin with "-" (replies then go to stdout and the log to stderr).
+// Connections are served one after the other and jobs run one at a
+// time, each with all threads; the thread pools stay warm in between.
+void serve(const char* socketPath, const Options& opt) {
+	Options defaults = opt;
+	defaults.prefetch = 0;		// a single image, decode on the job thread
+	defaults.jobs = 1;
+	defaults.pipeline = false;
+
+	int served = 0;
+	double latencySum = 0;
+	auto handle = [&](const string& line, string& reply) {
+		bool running = serveRequest(line, defaults, reply);
+		if (reply.compare(0, 3, "ok ") == 0) {
+			served++;
+			latencySum += atof(reply.c_str() + 3);
+		}
+		return running;
+	};
+
+	bool fromStdin = strcmp(socketPath, "-") == 0;
+	if (fromStdin) {
+		streambuf* stdoutBuffer = cout.rdbuf(cerr.rdbuf());
+		ostream replies(stdoutBuffer);
+
+		string line, reply;
+		bool running = true;
+		while (running && getline(cin, line)) {
+			running = handle(line, reply);
+			if (!reply.empty()) {
+				replies << reply << endl;
+			}
+		}
+		cout.rdbuf(stdoutBuffer);
+	} else {
+		int server = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (server < 0 || strlen(socketPath) >= sizeof(address.sun_path)) {
+			throw pfs::Exception("cannot create the server socket");
+		}
+		strcpy(address.sun_path, socketPath);
+
+		// a socket left by an earlier server is replaced, anything else is
+		// not ours to delete
+		struct stat status;
+		if (lstat(socketPath, &status) == 0) {
+			if (!S_ISSOCK(status.st_mode)) {
+				close(server);
+				throw pfs::Exception(str(format("%1% exists and is not a socket") % socketPath).c_str());
+			}
+			unlink(socketPath);
+		}
+		if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+			close(server);
+			throw pfs::Exception(str(format("cannot listen on %1%: %2%") % socketPath % strerror(errno)).c_str());
+		}
+		cout << format("serving on %1%") % socketPath << endl;
 
-		(*R)(i) = max((*R)(i) / y, 0.0f) * l;
-		(*G)(i) = max((*G)(i) / y, 0.0f) * l;
-		(*B)(i) = max((*B)(i) / y, 0.0f) * l;
+		bool running = true;
+		while (running) {
+			int client = accept(server, NULL, NULL);
+			if (client < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+
+			FILE* in = fdopen(client, "r");
+			char* buffer = NULL;
+			size_t capacity = 0;
+			ssize_t length;
+			while (running && (length = getline(&buffer, &capacity, in)) > 0) {
+				string line(buffer, length), reply;
+				running = handle(line, reply);
+				if (!reply.empty()) {
+					reply += "\n";
+					// the client may be gone, which must not raise SIGPIPE
+					send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+				}
+			}
+			free(buffer);
+			fclose(in);
+		}
+
+		close(server);
+		unlink(socketPath);
 	}
 
-	logTime("color corrected");
+	// stdout carries the replies when serving stdin
+	(fromStdin ? cerr : cout) << format("served %1% jobs, mean latency %2% s") % served % (served > 0 ? latencySum / served : 0.0) << endl;
+}
+
+ExrImage* loadImage(const string& exrFile, const Options& opt) {
+	OpenEXRReader reader(exrFile.c_str(), opt.read_mode, opt.exr_threads, opt.mmap);
+	if (opt.layer != NULL) {
+		reader.selectLayer(opt.layer);
+	}
 
-	// save tone mapping png file
-	unsigned char* mapBuffer = new unsigned char[valueCount];
-	for(int i = 0, pix = 0; pix < pixelCount; pix++ ) {
-		mapBuffer[i++] = (unsigned char)(clamp((*R)(pix), 0.0f, 1.0f) * maxValue8);
-		mapBuffer[i++] = (unsigned char)(clamp((*G)(pix), 0.0f, 1.0f) * maxValue8);
-		mapBuffer[i++] = (unsigned char)(clamp((*B)(pix), 0.0f, 1.0f) * maxValue8);
+	// a preview is processed as if it was the full frame
+	int frameW = reader.getPreviewWidth(opt.preview);
+	int frameH = reader.getPreviewHeight(opt.preview);
+	int minSize = tmo_fattal02_min_size(opt.fftsolver);
+	if (opt.preview > 1 && min(frameW, frameH) < minSize) {
+		throw pfs::Exception(str(format("--preview %1% of %2% gives %3%x%4%, below the %5% pixel minimum of the tone mapper")
+								 % opt.preview % exrFile % frameW % frameH % minSize).c_str());
 	}
 
-	logTime("converted to buffer");
+	// region of interest, tone mapped together with a margin around it so
+	// the attenuation near its border matches the full frame
+	int roiX = 0, roiY = 0, outW = frameW, outH = frameH;
+	int winX = 0, winY = 0, w = frameW, h = frameH;
+	if (opt.roi[2] > 0) {
+		roiX = opt.roi[0];
+		roiY = opt.roi[1];
+		outW = opt.roi[2];
+		outH = opt.roi[3];
+		if (roiX < 0 || roiY < 0 || roiX + outW > frameW || roiY + outH > frameH) {
+			throw pfs::Exception(str(format("--roi outside of the %1%x%2% image %3%") % frameW % frameH % exrFile).c_str());
+		}
 
-	unsigned char* simpleBuffer = new unsigned char[valueCount];
-	for(int i = 0, pix = 0; pix < pixelCount; pix++ ) {
-		vec3f current = {(*_R)(pix), (*_G)(pix), (*_B)(pix)};
-		vec3f simple = simpleTonemapping(current);
+		int margin = opt.roi_margin >= 0 ? opt.roi_margin : tmo_fattal02_margin(frameW, frameH, opt.fftsolver);
+		winX = max(roiX - margin, 0);
+		winY = max(roiY - margin, 0);
+		w = min(roiX + outW + margin, frameW) - winX;
+		h = min(roiY + outH + margin, frameH) - winY;
 
-		simpleBuffer[i++] = (unsigned char)(clamp(simple[0], 0.0f, 1.0f) * maxValue8);
-		simpleBuffer[i++] = (unsigned char)(clamp(simple[1], 0.0f, 1.0f) * maxValue8);
-		simpleBuffer[i++] = (unsigned char)(clamp(simple[2], 0.0f, 1.0f) * maxValue8);
+		// the window must hold the coarsest pyramid level, a small region
+		// or margin is padded further within the frame
+		if (min(frameW, frameH) < minSize) {
+			throw pfs::Exception(str(format("%1% is %2%x%3%, below the %4% pixel minimum of the tone mapper")
+									 % exrFile % frameW % frameH % minSize).c_str());
+		}
+		if (w < minSize) {
+			winX = max(min(winX - (minSize - w) / 2, frameW - minSize), 0);
+			w = minSize;
+		}
+		if (h < minSize) {
+			winY = max(min(winY - (minSize - h) / 2, frameH - minSize), 0);
+			h = minSize;
+		}
+		roiX -= winX;
+		roiY -= winY;
 	}
 
-	logTime("simple tone mapped");
-	Magick::Image mapImage(w, h, "RGB", Magick::CharPixel, mapBuffer);
-	Magick::Image simpleImage(w, h, "RGB", Magick::CharPixel, simpleBuffer);
-	
-	logTime("convert to Magick image");
+	// original RGB is kept for the colour correction and the simple tone
+	// mapping, luminance is derived from it while decoding
+	ExrImage* image = new ExrImage(exrFile, w, h, opt.half_planes);
+	image->roiX = roiX;
+	image->roiY = roiY;
+	image->roiWidth = outW;
+	image->roiHeight = outH;
 
-	simpleImage.modulate(100, 115, 100);
-	simpleImage.level(0, maxValue16 * 0.51, 1.0);
+	// the planes are large, a failed read must not leak them
+	try {
+		// the exposure of a region follows the whole frame, which is tone
+		// mapped from a preview of about 256 pixels on its smaller side
+		if (opt.roi[2] > 0) {
+			int factor = max(min(frameW, frameH) / 256, 1);
+			int pw = reader.getPreviewWidth(factor);
+			int ph = reader.getPreviewHeight(factor);
+			vector<float> rgb(3 * (size_t)pw * ph);
+			image->frameY = new pfs::Array2DImpl(pw, ph);
+			if (factor > 1) {
+				reader.readPreview(factor, &rgb[0], &rgb[(size_t)pw * ph], &rgb[2 * (size_t)pw * ph],
+								   image->frameY->getRawData());
+			} else {
+				reader.readRegion(0, 0, pw, ph, &rgb[0], &rgb[(size_t)pw * ph], &rgb[2 * (size_t)pw * ph],
+								  image->frameY->getRawData());
+			}
+		}
 
-	logTime("enhance");
+		if (opt.half_planes) {
+			if (opt.preview > 1) {
+				reader.readPreview(opt.preview, image->halfR, image->halfG, image->halfB, image->Y->getRawData());
+			} else {
+				reader.readRegion(winX, winY, w, h, image->halfR, image->halfG, image->halfB, image->Y->getRawData());
+			}
+		} else if (opt.preview > 1) {
+			reader.readPreview(opt.preview, image->R->getRawData(), image->G->getRawData(),
+							   image->B->getRawData(), image->Y->getRawData());
+		} else {
+			reader.readRegion(winX, winY, w, h, image->R->getRawData(), image->G->getRawData(),
+							  image->B->getRawData(), image->Y->getRawData());
+		}
+	}
+	catch (...) {
+		delete image;
+		throw;
+	}
+	image->decodeTime = reader.getDecodeTime();
 
-	mapImage.write(argv[2]);
-	simpleImage.write(argv[3]);
+	return image;
+}
+
+void toneMap(Frame& frame, int index, const Options& opt) {
+	const ExrImage* image = frame.image;
+	int w = image->width;
+	int h = image->height;
+	int roiX = image->roiX;
+	int roiY = image->roiY;
+	int outW = image->roiWidth;
+	int outH = image->roiHeight;
+
+	if (outW != w || outH != h) {
+		cout << format("roi: %1%x%2%, tone mapped window %3%x%4%") % outW % outH % w % h << endl;
+	}
+	cout << format("decode: %1% s (%2%)") % image->decodeTime % image->fileName << endl;
+
+	// temporaries of the tone mapper stay with the thread, so a batch or
+	// server of same sized frames allocates them once per worker
+	static thread_local FattalWorkspace workspace;
+
+	pfs::Array2DImpl* L = frame.L = new pfs::Array2DImpl(w, h);
+	tmo_fattal02(w, h, image->Y->getRawData(), L->getRawData(), opt.alpha, opt.beta,
+					opt.gamma, opt.noise, opt.detail_level,
+					opt.black_point, opt.white_point, opt.fftsolver, opt.fft_float, &workspace);
+
+	if (image->frameY != NULL) {
+		// separate temporaries, the preview differs in size from the region
+		static thread_local FattalWorkspace frameWorkspace;
+		pfs::Array2DImpl* frameY = image->frameY;
+		int fw = frameY->getCols();
+		int fh = frameY->getRows();
+		vector<float> frameL((size_t)fw * fh);
+		tmo_fattal02(fw, fh, frameY->getRawData(), &frameL[0], opt.alpha, opt.beta,
+						opt.gamma, opt.noise, opt.detail_level,
+						opt.black_point, opt.white_point, opt.fftsolver, opt.fft_float, &frameWorkspace);
+		frame.lMean = meanL(&frameL[0], fw, fh, fw);
+	}
+
+	logTime("tone mapped");
+	if (opt.fftsolver) {
+		double planning, execution;
+		pde_fft_timing(planning, execution);
+		cout << format("fft: planning %1% s, execution %2% s") % planning % execution << endl;
+	}
+
+	if (opt.hdr_out != NULL) {
+		format hdrName(opt.hdr_out);
+		hdrName.exceptions(io::all_error_bits ^ io::too_many_args_bit);
+
+		OpenEXRWriter writer(str(hdrName % (index + 1)).c_str(), opt.exr_threads);
+		writer.setCompression(opt.exr_compression);
+		writer.setHalf(!opt.exr_float);
+		writer.setTileSize(opt.exr_tile);
+		writer.writeLuminance(L->getRawData() + roiY * w + roiX, outW, outH, w);
+
+		logTime("hdr written");
+	}
+}
+
+// mean of max(L, 1e-4) over width x height values, rows stride apart
+float meanL(const float* L, int width, int height, int stride) {
+	static const float epsilon = 1e-4f;
+	double lSum = 0;
+	#pragma omp parallel for reduction(+:lSum)
+	for (int row = 0; row < height; row++) {
+		const float* l = L + (size_t)row * stride;
+		float rowSum = 0;
+		for (int col = 0; col < width; col++) {
+			rowSum += max(l[col], epsilon);
+		}
+		lSum += rowSum;
+	}
+	return lSum / ((double)width * height);
+}
+
+void postProcess(Frame& frame) {
+	const ExrImage* image = frame.image;
+	pfs::Array2DImpl* L = frame.L;
+	int w = image->width;
+	int roiX = image->roiX;
+	int roiY = image->roiY;
+	int outW = image->roiWidth;
+	int outH = image->roiHeight;
+	pfs::Array2DImpl* R = image->R;	// NULL with half planes
+	pfs::Array2DImpl* G = image->G;
+	pfs::Array2DImpl* B = image->B;
+	pfs::Array2DImpl* Y = image->Y;
+
+	int pixelCount = outW * outH;
+	int valueCount = pixelCount * 3;
 
-	// opacity here! difference from weight
-	simpleImage.opacity(maxValue16 * 0.7);
-	mapImage.opacity(maxValue16 * 0.35);
+	// Color correction, a region takes the mean of the whole frame so
+	// that neighbouring regions get the same exposure
+	float lMean = frame.lMean >= 0 ? frame.lMean : meanL(L->getRawData() + (size_t)roiY * w + roiX, outW, outH, w);
+	float lRatio = 1;
+	if (lMean < (155.0 / 255)) {
+		lRatio = (155.0 / 255) / lMean;
+	}
+	cout << "lRatio: " << lRatio << endl;
 
-	logTime("opacity");
+	// one pass over the rows reads the original colour, Y and L once and
+	// writes the corrected colour of the map image, the enhanced simple
+	// tone mapping and their fusion
+	unsigned char* mapBuffer = frame.mapBuffer = new unsigned char[valueCount];
+	unsigned char* simpleBuffer = frame.simpleBuffer = new unsigned char[valueCount];
+	unsigned char* fusionBuffer = frame.fusionBuffer = new unsigned char[valueCount];
+	#pragma omp parallel
+	{
+		// half planes are widened a row at a time
+		vector<float> rowBuffer(image->halfR != NULL ? 3 * outW : 0);
 
-	simpleImage.composite(mapImage, 0, 0, Magick::CompositeOperator::MultiplyCompositeOp);
+		#pragma omp for schedule(static)
+		for (int row = 0; row < outH; row++) {
+			size_t offset = (size_t)(roiY + row) * w + roiX;
+			const float *r, *g, *b;
+			if (image->halfR != NULL) {
+				halfToFloat(image->halfR + offset, &rowBuffer[0], outW);
+				halfToFloat(image->halfG + offset, &rowBuffer[outW], outW);
+				halfToFloat(image->halfB + offset, &rowBuffer[2 * outW], outW);
+				r = &rowBuffer[0];
+				g = &rowBuffer[outW];
+				b = &rowBuffer[2 * outW];
+			} else {
+				r = R->getRawData() + offset;
+				g = G->getRawData() + offset;
+				b = B->getRawData() + offset;
+			}
+			const float* y = Y->getRawData() + offset;
+			const float* l = L->getRawData() + offset;
+			unsigned char* map = mapBuffer + (size_t)row * outW * 3;
+			unsigned char* simple = simpleBuffer + (size_t)row * outW * 3;
+			unsigned char* fusion = fusionBuffer + (size_t)row * outW * 3;
 
-	logTime("composite");
+			postProcessRow(r, g, b, y, l, outW, lRatio, map, simple, fusion);
+		}
+	}
 
-	simpleImage.opacity(0);
-	simpleImage.quality(100);
-	simpleImage.depth(8);
+	logTime("post processed");
+}
 
-	logTime("prepare write");
+void encode(Frame& frame, const Job& job, const Options& opt, int threads) {
+	int outW = frame.image->roiWidth;
+	int outH = frame.image->roiHeight;
 
-	simpleImage.write(argv[4]);
+	// the three images are encoded concurrently and share the threads of
+	// the caller, async threads do not inherit its OpenMP team size
+	int encoderThreads = max(threads / 3, 1);
+	future<void> mapWrite = async(launch::async, writeOutput, job.mapFile.c_str(), frame.mapBuffer,
+								  outW, outH, 0, encoderThreads, cref(opt));
+	future<void> simpleWrite = async(launch::async, writeOutput, job.simpleFile.c_str(), frame.simpleBuffer,
+									 outW, outH, 0, encoderThreads, cref(opt));
+	future<void> fusionWrite = async(launch::async, writeOutput, job.fusionFile.c_str(), frame.fusionBuffer,
+									 outW, outH, 100, encoderThreads, cref(opt));
+	mapWrite.get();
+	simpleWrite.get();
+	fusionWrite.get();
 
 	logTime("complete");
+}
 
-	delete[] mapBuffer;
-	delete[] simpleBuffer;
-	delete X;
-	delete Y;
-	delete Z;
-	delete G;    
-	delete L;
-	delete _R;
-	delete _G;
-	delete _B;
-	delete __R;
-	delete __G;
-	delete __B;
+// PNG and JPEG are encoded directly, other formats through Magick.
+// quality 0 keeps the encoder default, threads bounds the png band encoder
+void writeOutput(const char* fileName, const unsigned char* buffer, int width, int height,
+				 int quality, int threads, const Options& opt) {
+	RgbImageWriter writer(fileName);
+	if (writer.getFormat() == RgbImageWriter::FORMAT_UNKNOWN) {
+		Magick::Image image(width, height, "RGB", Magick::CharPixel, buffer);
+		if (quality > 0) {
+			image.quality(quality);
+		}
+		image.depth(8);
+		image.write(fileName);
+		return;
+	}
 
-	return EXIT_SUCCESS;
+	writer.setPngLevel(opt.png_level);
+	writer.setPngFilters(opt.png_filters);
+	writer.setPngBands(opt.png_bands);
+	writer.setThreads(threads);
+	if (quality > 0) {
+		writer.setJpegQuality(quality);
+	}
+	writer.writeImage(buffer, width, height);
 }
 
-inline vec3f simpleTonemapping(const vec3f& color) {
-	vec3f bloomed_Yxy = rgb2Yxy(color);
-	float scaled_Y = bloomed_Yxy[0];
+// corrected colour of the map image, simple tone mapping and their fusion
+// for one row, written as interleaved 8-bit RGB
+void postProcessRow(const float* r, const float* g, const float* b, const float* y, const float* l,
+					int width, float lRatio, unsigned char* map, unsigned char* simple, unsigned char* fusion) {
+	const float epsilon = 1e-4f;
+	const float maxValue8 = (float)(1<<8) - 1;
 
-	if (color[0] < 1e-7f && color[1] < 1e-7f && color[2] < 1e-7f) {
-		return color;
-	} else {
-		vec3f result = {scaled_Y / (scaled_Y + 1.0f), bloomed_Yxy[1], bloomed_Yxy[2]};
-		return Yxy2rgb(result);
+	// enhancement of the simple image, as Magick modulate(100, 115, 100)
+	// and level(0, 51%); without Magick's 16-bit rounding between steps,
+	// this and the composite below can be one 8-bit step off its output
+	const float saturation = 1.15f;
+	const float whitePoint = 0.51f;
+
+	// multiply composite of the map (opacity 35%) over the simple image
+	// (opacity 70%), un-premultiplied by the combined alpha
+	const float mapAlpha = 1.0f - 0.35f;
+	const float simpleAlpha = 1.0f - 0.7f;
+	const float alpha = mapAlpha + simpleAlpha - mapAlpha * simpleAlpha;
+	const float weightBoth = mapAlpha * simpleAlpha / alpha;
+	const float weightMap = mapAlpha * (1.0f - simpleAlpha) / alpha;
+	const float weightSimple = simpleAlpha * (1.0f - mapAlpha) / alpha;
+
+	// values rather than std::max/min references keep the loop free of
+	// loads through selected pointers, so it vectorises
+	#pragma omp simd
+	for (int col = 0; col < width; col++) {
+		float yc = y[col] > epsilon ? y[col] : epsilon;
+		float lc = clamp((l[col] > epsilon ? l[col] : epsilon) * lRatio, 0.0f, 1.0f);
+		float rc = r[col] / yc, gc = g[col] / yc, bc = b[col] / yc;
+
+		unsigned char mr = (unsigned char)(clamp((rc > 0.0f ? rc : 0.0f) * lc, 0.0f, 1.0f) * maxValue8);
+		unsigned char mg = (unsigned char)(clamp((gc > 0.0f ? gc : 0.0f) * lc, 0.0f, 1.0f) * maxValue8);
+		unsigned char mb = (unsigned char)(clamp((bc > 0.0f ? bc : 0.0f) * lc, 0.0f, 1.0f) * maxValue8);
+		map[col * 3 + 0] = mr;
+		map[col * 3 + 1] = mg;
+		map[col * 3 + 2] = mb;
+
+		float sr, sg, sb;
+		simpleTonemapping(r[col], g[col], b[col], sr, sg, sb);
+
+		// the enhancement starts from the 8-bit simple tone mapping
+		sr = (unsigned char)(clamp(sr, 0.0f, 1.0f) * maxValue8) / maxValue8;
+		sg = (unsigned char)(clamp(sg, 0.0f, 1.0f) * maxValue8) / maxValue8;
+		sb = (unsigned char)(clamp(sb, 0.0f, 1.0f) * maxValue8) / maxValue8;
+
+		// with hue and lightness unchanged, scaling the HSL saturation
+		// moves each channel away from the lightness by the same factor
+		float maxC = sr > sg ? (sr > sb ? sr : sb) : (sg > sb ? sg : sb);
+		float minC = sr < sg ? (sr < sb ? sr : sb) : (sg < sb ? sg : sb);
+		float lightness = (maxC + minC) * 0.5f;
+		sr = clamp(clamp(lightness + (sr - lightness) * saturation, 0.0f, 1.0f) / whitePoint, 0.0f, 1.0f);
+		sg = clamp(clamp(lightness + (sg - lightness) * saturation, 0.0f, 1.0f) / whitePoint, 0.0f, 1.0f);
+		sb = clamp(clamp(lightness + (sb - lightness) * saturation, 0.0f, 1.0f) / whitePoint, 0.0f, 1.0f);
+
+		simple[col * 3 + 0] = (unsigned char)(sr * maxValue8 + 0.5f);
+		simple[col * 3 + 1] = (unsigned char)(sg * maxValue8 + 0.5f);
+		simple[col * 3 + 2] = (unsigned char)(sb * maxValue8 + 0.5f);
+
+		float fr = mr / maxValue8, fg = mg / maxValue8, fb = mb / maxValue8;
+		fr = weightBoth * fr * sr + weightMap * fr + weightSimple * sr;
+		fg = weightBoth * fg * sg + weightMap * fg + weightSimple * sg;
+		fb = weightBoth * fb * sb + weightMap * fb + weightSimple * sb;
+
+		fusion[col * 3 + 0] = (unsigned char)(clamp(fr, 0.0f, 1.0f) * maxValue8 + 0.5f);
+		fusion[col * 3 + 1] = (unsigned char)(clamp(fg, 0.0f, 1.0f) * maxValue8 + 0.5f);
+		fusion[col * 3 + 2] = (unsigned char)(clamp(fb, 0.0f, 1.0f) * maxValue8 + 0.5f);
 	}
 }
 
-inline vec3f rgb2Yxy(vec3f rgb) {
-	float X = rgb[0] * 0.4124f + rgb[1] * 0.3576f + rgb[2] * 0.1805f;
-	float Y = rgb[0] * 0.2126f + rgb[1] * 0.7152f + rgb[2] * 0.0722f;
-	float Z = rgb[0] * 0.0193f + rgb[1] * 0.1192f + rgb[2] * 0.9505f;
+inline void simpleTonemapping(float r, float g, float b, float& outR, float& outG, float& outB) {
+	float bloomed_Y, bloomed_x, bloomed_y;
+	rgb2Yxy(r, g, b, bloomed_Y, bloomed_x, bloomed_y);
+	float scaled_Y = bloomed_Y;
+
+	Yxy2rgb(scaled_Y / (scaled_Y + 1.0f), bloomed_x, bloomed_y, outR, outG, outB);
+
+	// selected rather than branched on so the pixel loop vectorises
+	bool black = (r < 1e-7f) & (g < 1e-7f) & (b < 1e-7f);
+	outR = black ? r : outR;
+	outG = black ? g : outG;
+	outB = black ? b : outB;
+}
+
+inline void rgb2Yxy(float r, float g, float b, float& Y, float& x, float& y) {
+	float X = r * 0.4124f + g * 0.3576f + b * 0.1805f;
+	Y = r * 0.2126f + g * 0.7152f + b * 0.0722f;
+	float Z = r * 0.0193f + g * 0.1192f + b * 0.9505f;
 
-	vec3f result = {Y, X / (X + Y + Z), Y / (X + Y + Z)};
-	return result;
+	x = X / (X + Y + Z);
+	y = Y / (X + Y + Z);
 }
 
-inline vec3f Yxy2rgb(vec3f Yxy) {
+inline void Yxy2rgb(float Y, float x, float y, float& r, float& g, float& b) {
 	// First convert to xyz
-	vec3f xyz = {Yxy[1] * (Yxy[0] / Yxy[2]), Yxy[0], (1.0f - Yxy[1] - Yxy[2]) * (Yxy[0] / Yxy[2])};
-
-	float R = xyz[0] *  3.2410f + xyz[1] * -1.5374f + xyz[2] * -0.4986f;
-	float G = xyz[0] * -0.9692f + xyz[1] *  1.8760f + xyz[2] *  0.0416f;
-	float B = xyz[0] *  0.0556f + xyz[1] * -0.2040f + xyz[2] *  1.0570f;
+	float X = x * (Y / y);
+	float Z = (1.0f - x - y) * (Y / y);
 
-	vec3f result = {R, G, B};
-	return result;
+	r = X *  3.2410f + Y * -1.5374f + Z * -0.4986f;
+	g = X * -0.9692f + Y *  1.8760f + Z *  0.0416f;
+	b = X *  0.0556f + Y * -0.2040f + Z *  1.0570f;
 }
 
 template<class T>
@@ -237,7 +1070,42 @@ inline T clamp(const T v, const T minV, const T maxV) {
 	return v;
 }
 
+void printHelp(const char* prog) {
+	cout << format("Usage: %1% [options] <exr image> <map image> <simple image> <fusion image> [<exr image> ...]") % prog << endl;
+	cout << format("       %1% [options] --batch <manifest>") % prog << endl;
+	cout << format("       %1% [options] --serve <socket|->") % prog << endl;
+	cout << "\t[--rgba-read]  decode through the interleaved RGBA buffer instead of planar slices" << endl;
+	cout << "\t[--exr-threads <n>]  OpenEXR decoding threads (default: OpenMP pool size)" << endl;
+	cout << "\t[--mmap]  read the exr image through a memory mapping" << endl;
+	cout << "\t[--roi <x,y,width,height>]  tone map and write only this region, exposed like the whole frame" << endl;
+	cout << "\t[--roi-margin <n>]  context around the region (default: pyramid footprint)" << endl;
+	cout << "\t[--hdr-out <exr file>]  also write the tone mapped luminance L (%1% = image number)" << endl;
+	cout << "\t[--exr-compression <none|zips|zip|piz|dwaa|...>]  (default: zip)" << endl;
+	cout << "\t[--exr-float]  write float instead of half channels" << endl;
+	cout << "\t[--exr-tile <n>]  write n x n tiles instead of scanlines" << endl;
+	cout << "\t[--layer <name>]  tone map this layer or part (e.g. beauty, diffuse)" << endl;
+	cout << "\t[--list-layers] <exr image>  print the RGB layers of the image" << endl;
+	cout << "\t[--preview <n>]  process every n-th row and column only" << endl;
+	cout << "\t[--prefetch <n>]  decode up to n images ahead, 0 disables read-ahead (default: 1)" << endl;
+	cout << "\t[--half-planes]  keep the colour planes as half floats, luminance stays float" << endl;
+	cout << "\t[--fft-float]  solve the Poisson equation with single instead of double precision transforms" << endl;
+	cout << "\t[--fft-plan <estimate|measure|patient>]  fftw planning effort, spent once per size (default: estimate)" << endl;
+	cout << "\t[--fft-wisdom <file>]  load and save fftw wisdom, single precision in <file>.f" << endl;
+	cout << "\t[--png-level <0-9>]  zlib level of png outputs (default: 7)" << endl;
+	cout << "\t[--png-filter <none|sub|up|avg|paeth|all>]  png row filter (default: all, chosen per row)" << endl;
+	cout << "\t[--png-bands <n>]  deflate png outputs in n row bands in parallel (default: 1)" << endl;
+	cout << "\t[--batch <manifest>]  process the <exr> <map> <simple> <fusion> lines of the manifest (- for stdin)" << endl;
+	cout << "\t[--jobs <n>]  images processed concurrently, sharing the OpenMP threads (default: 1)" << endl;
+	cout << "\t[--pipeline]  overlap decode, tone mapping, post-processing and encoding of consecutive images" << endl;
+	cout << "\t[--stage-threads <d,t,p,e>]  OpenMP threads of the pipeline stages (default: n/4,n,n/4,n/4)" << endl;
+	cout << "\t[--serve <socket|->]  run as a server taking \"<exr> <map> <simple> <fusion> [name=value ...]\" lines" << endl;
+	cout << "\t[--help]" << endl;
+}
+
 void logTime(const string& message) {
+	static mutex logMutex;
+	lock_guard<mutex> lock(logMutex);
+
 	gettimeofday(&tpend, NULL);
 	double timeuse = (1000000 * (tpend.tv_sec - tpstart.tv_sec) + tpend.tv_usec - tpstart.tv_usec) / 1000000.0;
 	cout << format("[%1%] %2%") % timeuse % message << endl;
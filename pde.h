@@ -61,8 +61,34 @@ void solve_pde_sor(pfstmo::Array2D *F, pfstmo::Array2D *U, int maxits=SOR_MAXITS
  * @param F array of the right hand side (contains div G in this example)
  * @param U [out] solution
  * @param adjust_bound, adjust boundary values of F to make pde solvable 
+ * @param single_precision, transform in single precision (fftwf) instead
+ * of converting to double, needs half the memory and bandwidth
  */
-void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound=false);
+void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound=false,
+                   bool single_precision=false);
+
+/// planning effort of the fft solver, see FFTW_ESTIMATE, FFTW_MEASURE and
+/// FFTW_PATIENT
+enum PdeFftPlanning { PDE_FFT_ESTIMATE, PDE_FFT_MEASURE, PDE_FFT_PATIENT };
+
+/**
+ * @brief sets how the fft solver plans its transforms
+ *
+ * Plans are cached per size, precision and thread count for the lifetime
+ * of the process, so the effort is spent once per size. With a wisdom
+ * file the planner starts from the wisdom of earlier runs and saves what
+ * it learns, single precision wisdom goes to wisdom_file with ".f" appended.
+ *
+ * @param effort planning effort of new plans
+ * @param wisdom_file wisdom to load and save, NULL for none
+ */
+void pde_fft_set_planning(PdeFftPlanning effort, const char* wisdom_file);
+
+/**
+ * @brief seconds the calling thread spent planning and executing fft
+ * transforms since the last call
+ */
+void pde_fft_timing(double& planning, double& execution);
 
 /**
  * @brief returns the residual error of the solution U, ie norm(Laplace U - F) 
@@ -77,8 +103,10 @@ float residual_pde(pfstmo::Array2D *U, pfstmo::Array2D *F);
  *
  * @param width
  * @param height
+ * @param single_precision, test the single precision transform
  */
-double error_estim_pde_fft(unsigned int width, unsigned int height);
+double error_estim_pde_fft(unsigned int width, unsigned int height,
+                           bool single_precision=false);
 double error_estim_pde_fft_d(unsigned int width, unsigned int height);
 
 
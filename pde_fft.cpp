@@ -39,10 +39,15 @@
 #include <stdlib.h>
 #include <math.h>
 #include <omp.h>
+#include <sys/time.h>
 #include <vector>
+#include <map>
+#include <string>
+#include <mutex>
 #include <fftw3.h>
 
 #include <array2d.h>
+#include <pfs.h>
 
 #include <config.h>
 
@@ -56,80 +61,172 @@ using namespace std;
 #endif
 
 
-// returns T = EVy A EVx^tr
-// note, modifies input data
-void transform_ev2normal(pfstmo::Array2Dd *A, pfstmo::Array2Dd *T)
+// only the execution of plans is thread safe, plans of concurrent tone
+// mapping jobs are created under this lock
+static mutex plannerMutex;
+
+// planning effort of new plans and the files wisdom is kept in
+static unsigned planFlags = FFTW_ESTIMATE;
+static string wisdomFile;
+
+// time the calling thread spent planning and executing transforms since
+// the last pde_fft_timing()
+static thread_local double planTime = 0.0;
+static thread_local double executeTime = 0.0;
+
+static double seconds()
 {
-  int width = A->getCols();
-  int height = A->getRows();
-  assert((int)T->getCols()==width && (int)T->getRows()==height);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
 
-  // the discrete cosine transform is not exactly the transform needed
-  // need to scale input values to get the right transformation
-  for(int y=1 ; y<height-1 ; y++ )
-    for(int x=1 ; x<width-1 ; x++ )
-      (*A)(x,y)*=0.25;
+// the fftw interface of one precision, fftw for double and fftwf for float
+template <typename T> struct FFTW;
 
-  for(int x=1 ; x<width-1 ; x++ )
+template <> struct FFTW<double>
+{
+  typedef fftw_plan plan;
+
+  static plan plan_dct_2d(int width, int height, double* in, double* out, int threads)
   {
-    (*A)(x,0)*=0.5;
-    (*A)(x,height-1)*=0.5;
+    static bool threadsInitialized = false;
+    if( !threadsInitialized )
+    {
+      fftw_init_threads();
+      threadsInitialized = true;
+    }
+    fftw_plan_with_nthreads(threads);
+    return fftw_plan_r2r_2d(height, width, in, out,
+                            FFTW_REDFT00, FFTW_REDFT00, planFlags);
   }
-  for(int y=1 ; y<height-1 ; y++ )
+  static void execute(plan p, double* in, double* out) { fftw_execute_r2r(p, in, out); }
+  static int alignment_of(double* p) { return fftw_alignment_of(p); }
+  static double* alloc(size_t n) { return (double*) fftw_malloc(sizeof(double) * n); }
+  static void free(double* p) { fftw_free(p); }
+  static string wisdom_file() { return wisdomFile; }
+  static void import_wisdom(const char* file) { fftw_import_wisdom_from_filename(file); }
+  static void export_wisdom(const char* file) { fftw_export_wisdom_to_filename(file); }
+};
+
+#ifdef HAVE_FFTW3F
+template <> struct FFTW<float>
+{
+  typedef fftwf_plan plan;
+
+  static plan plan_dct_2d(int width, int height, float* in, float* out, int threads)
   {
-    (*A)(0,y)*=0.5;
-    (*A)(width-1,y)*=0.5;
+    static bool threadsInitialized = false;
+    if( !threadsInitialized )
+    {
+      fftwf_init_threads();
+      threadsInitialized = true;
+    }
+    fftwf_plan_with_nthreads(threads);
+    return fftwf_plan_r2r_2d(height, width, in, out,
+                             FFTW_REDFT00, FFTW_REDFT00, planFlags);
   }
+  static void execute(plan p, float* in, float* out) { fftwf_execute_r2r(p, in, out); }
+  static int alignment_of(float* p) { return fftwf_alignment_of(p); }
+  static float* alloc(size_t n) { return (float*) fftwf_malloc(sizeof(float) * n); }
+  static void free(float* p) { fftwf_free(p); }
+  // wisdom of both precisions cannot share a file
+  static string wisdom_file() { return wisdomFile.empty() ? wisdomFile : wisdomFile + ".f"; }
+  static void import_wisdom(const char* file) { fftwf_import_wisdom_from_filename(file); }
+  static void export_wisdom(const char* file) { fftwf_export_wisdom_to_filename(file); }
+};
+#endif
 
-  // note, fftw provides its own memory allocation routines which
-  // ensure that memory is properly 16/32 byte aligned so it can
-  // use SSE/AVX operations (2/4 double ops in parallel), if our
-  // data is not properly aligned fftw won't use SSE/AVX
-  // (I believe new() aligns memory to 16 byte so avoid overhead here)
-  //
-  // double* in = (double*) fftw_malloc(sizeof(double) * width*height);
-  // fftw_free(in);
-
-  // executes 2d discrete cosine transform
-  fftw_plan p;
-  p=fftw_plan_r2r_2d(height, width, A->getRawData(), T->getRawData(),
-                        FFTW_REDFT00, FFTW_REDFT00, FFTW_ESTIMATE);
-  fftw_execute(p); 
-  fftw_destroy_plan(p);
-}
-
-
-// returns T = EVy^-1 * A * (EVx^-1)^tr
-void transform_normal2ev(pfstmo::Array2Dd *A, pfstmo::Array2Dd *T)
+// what a plan is specific to, besides the precision
+struct PlanKey
 {
-  int width = A->getCols();
-  int height = A->getRows();
-  assert((int)T->getCols()==width && (int)T->getRows()==height);
-
-  // executes 2d discrete cosine transform
-  fftw_plan p;
-  p=fftw_plan_r2r_2d(height, width, A->getRawData(), T->getRawData(),
-                        FFTW_REDFT00, FFTW_REDFT00, FFTW_ESTIMATE);
-  fftw_execute(p); 
-  fftw_destroy_plan(p);
-
-  // need to scale the output matrix to get the right transform
-  for(int y=0 ; y<height ; y++ )
-    for(int x=0 ; x<width ; x++ )
-      (*T)(x,y)*=(1.0/((height-1)*(width-1)));
+  int width, height, threads;
+  bool inplace;
+  int alignIn, alignOut;
 
-  for(int x=0 ; x<width ; x++ )
+  bool operator<(const PlanKey& o) const
   {
-    (*T)(x,0)*=0.5;
-    (*T)(x,height-1)*=0.5;
+    if( width!=o.width ) return width<o.width;
+    if( height!=o.height ) return height<o.height;
+    if( threads!=o.threads ) return threads<o.threads;
+    if( inplace!=o.inplace ) return inplace<o.inplace;
+    if( alignIn!=o.alignIn ) return alignIn<o.alignIn;
+    return alignOut<o.alignOut;
   }
-  for(int y=0 ; y<height ; y++ )
+};
+
+// returns the cached plan for this transform, planning it on scratch
+// arrays of the same alignment the first time (measuring destroys the
+// data), the wisdom file is read before the first and written after
+// every new plan
+template <typename T>
+static typename FFTW<T>::plan cached_plan(const PlanKey& key)
+{
+  static map<PlanKey, typename FFTW<T>::plan> cache;
+  static bool wisdomLoaded = false;
+
+  lock_guard<mutex> lock(plannerMutex);
+  typename map<PlanKey, typename FFTW<T>::plan>::iterator it = cache.find(key);
+  if( it!=cache.end() )
+    return it->second;
+
+  double start = seconds();
+  string file = FFTW<T>::wisdom_file();
+  if( !wisdomLoaded && !file.empty() )
   {
-    (*T)(0,y)*=0.5;
-    (*T)(width-1,y)*=0.5;
+    FFTW<T>::import_wisdom(file.c_str());
+    wisdomLoaded = true;
   }
+
+  size_t size = (size_t) key.width * key.height;
+  char* scratchIn = (char*) FFTW<T>::alloc(size + 16);
+  char* scratchOut = key.inplace ? scratchIn : (char*) FFTW<T>::alloc(size + 16);
+  T* in = (T*) (scratchIn + key.alignIn);
+  T* out = (T*) (scratchOut + key.alignOut);
+  typename FFTW<T>::plan p = FFTW<T>::plan_dct_2d(key.width, key.height, in, out, key.threads);
+  FFTW<T>::free((T*) scratchIn);
+  if( !key.inplace )
+    FFTW<T>::free((T*) scratchOut);
+  if( p==NULL )
+    throw pfs::Exception("fftw: cannot plan the cosine transform");
+
+  if( !file.empty() )
+    FFTW<T>::export_wisdom(file.c_str());
+  cache[key] = p;
+  planTime += seconds() - start;
+  return p;
 }
 
+// executes the 2d DCT-I of in into out (which may be in), the plan uses
+// as many threads as the calling thread's OpenMP team would have
+template <typename T>
+static void dct_2d(int width, int height, T* in, T* out)
+{
+  PlanKey key = { width, height, omp_get_max_threads(), in==out,
+                  FFTW<T>::alignment_of(in), FFTW<T>::alignment_of(out) };
+  typename FFTW<T>::plan p = cached_plan<T>(key);
+
+  double start = seconds();
+  FFTW<T>::execute(p, in, out);
+  executeTime += seconds() - start;
+}
+
+void pde_fft_set_planning(PdeFftPlanning effort, const char* wisdom_file)
+{
+  lock_guard<mutex> lock(plannerMutex);
+  planFlags = effort==PDE_FFT_PATIENT ? FFTW_PATIENT :
+              effort==PDE_FFT_MEASURE ? FFTW_MEASURE : FFTW_ESTIMATE;
+  wisdomFile = wisdom_file!=NULL ? wisdom_file : "";
+}
+
+void pde_fft_timing(double& planning, double& execution)
+{
+  planning = planTime;
+  execution = executeTime;
+  planTime = executeTime = 0.0;
+}
+
+
 // returns the eigenvalues of the 1d laplace operator
 std::vector<double> get_lambda(int n)
 {
@@ -142,7 +239,8 @@ std::vector<double> get_lambda(int n)
 }
 
 // makes boundary conditions compatible so that a solution exists
-void make_compatible_boundary(pfstmo::Array2Dd *F)
+template <typename T>
+void make_compatible_boundary(pfstmo::Array2DBase<T> *F)
 {
   int width = F->getCols();
   int height = F->getRows();
@@ -184,19 +282,24 @@ void make_compatible_boundary(pfstmo::Array2Dd *F)
 // the equation has a solution, if adjust_bound is set to false then F is
 // not modified and the equation might not have a solution but an
 // approximate solution with a minimum error is then calculated
-// double precision version
+// in the precision T of the arrays, U may be F
+// returns the largest value of U (at least 0), which the caller removes
 // note, input data F might be modified
-void solve_pde_fft(pfstmo::Array2Dd *F, pfstmo::Array2Dd *U, bool adjust_bound)
+//
+// the transform into the eigenvector space, EVy^-1 F (EVx^-1)^tr, is the
+// 2d DCT-I scaled by 1/((height-1)(width-1)) and by 0.5 on the first and
+// last row and column, the transform back, EVy U_tr EVx^tr, is the DCT-I
+// of U_tr scaled by 0.5 off the first and last row and 0.5 off the first
+// and last column; along each axis the two weights multiply to 0.5, so
+// together with the eigenvalues all scaling is one factor per element
+template <typename T>
+T solve_pde_dct(pfstmo::Array2DBase<T> *F, pfstmo::Array2DBase<T> *U, bool adjust_bound)
 {
   DEBUG_STR << "solve_pde_fft: solving Laplace U = F ..." << std::endl;
   int width = F->getCols();
   int height = F->getRows();
   assert((int)U->getCols()==width && (int)U->getRows()==height);
 
-  // activate parallel execution of fft routines
-  fftw_init_threads();
-  fftw_plan_with_nthreads(omp_get_max_threads());
-
   // in general there might not be a solution to the Poisson pde
   // with Neumann boundary conditions unless the boundary satisfies
   // an integral condition, this function modifies the boundary so that
@@ -207,77 +310,103 @@ void solve_pde_fft(pfstmo::Array2Dd *F, pfstmo::Array2Dd *U, bool adjust_bound)
     make_compatible_boundary(F);
   }
 
-  // transforms F into eigenvector space: Ftr = 
+  // transforms F into eigenvector space, unscaled, into U
   DEBUG_STR << "solve_pde_fft: transform F to ev space (fft)" << std::endl;
-  pfstmo::Array2Dd* F_tr = new pfstmo::Array2Dd(width,height);
-  transform_normal2ev(F, F_tr);
-  F->allocate(1,1);       // no longer needed so release memory (better not?)
-  DEBUG_STR << "solve_pde_fft: F_tr(0,0) = " << (*F_tr)(0,0);
+  T* u = U->getRawData();
+  dct_2d(width, height, F->getRawData(), u);
+  DEBUG_STR << "solve_pde_fft: F_tr(0,0) = " << u[0];
   DEBUG_STR << " (must be 0 for solution to exist)" << std::endl;
 
   // in the eigenvector space the solution is very simple
   DEBUG_STR << "solve_pde_fft: solve in eigenvector space" << std::endl;
-  pfstmo::Array2Dd* U_tr = new pfstmo::Array2Dd(width,height);
   std::vector<double> l1=get_lambda(height);
   std::vector<double> l2=get_lambda(width);
+  const double scale=0.25/((double)(height-1)*(width-1));
+  #pragma omp parallel for
   for(int y=0 ; y<height ; y++ )
+  {
+    T* row = u + (size_t)y*width;
     for(int x=0 ; x<width ; x++ )
-    {
-      if(x==0 && y==0)
-        (*U_tr)(x,y)=0.0; // any value ok, only adds a const to the solution
-      else
-        (*U_tr)(x,y)=(*F_tr)(x,y)/(l1[y]+l2[x]);
-    }
-  delete F_tr;    // no longer needed so release memory
-
+      row[x]*=scale/(l1[y]+l2[x]);
+  }
+  u[0]=0.0;   // any value ok, only adds a const to the solution
 
-  // transforms U_tr back to the normal space
+  // transforms U_tr back to the normal space, in place
   DEBUG_STR << "solve_pde_fft: transform U_tr to normal space (fft)" << std::endl;
-  transform_ev2normal(U_tr, U);
-  delete U_tr;    // no longer needed so release memory
+  dct_2d(width, height, u, u);
 
   // the solution U as calculated will satisfy something like int U = 0
   // since for any constant c, U-c is also a solution and we are mainly
   // working in the logspace of (0,1) data we prefer to have
   // a solution which has no positive values: U_new(x,y)=U(x,y)-max
   // (not really needed but good for numerics as we later take exp(U))
-  DEBUG_STR << "solve_pde_fft: removing constant from solution" << std::endl;
-  double max=0.0;
-  for(int i=0; i<width*height; i++) {    
-    if(max<(*U)(i))
-      max=(*U)(i);
-  }
-
+  T max=0.0;
+  #pragma omp parallel for reduction(max: max)
   for(int i=0; i<width*height; i++)
-    (*U)(i)-=max;
-
+    max = u[i]>max ? u[i] : max;
 
   // fft parallel threads cleanup, better handled outside this function
   // fftw_cleanup_threads();
 
   DEBUG_STR << "solve_pde_fft: done" << std::endl;
+  return max;
+}
+
+// subtracts c from all values of A
+template <typename T>
+static void subtract(pfstmo::Array2DBase<T> *A, T c)
+{
+  T* a = A->getRawData();
+  int size = A->getCols() * A->getRows();
+  #pragma omp parallel for
+  for(int i=0; i<size; i++)
+    a[i]-=c;
+}
+
+// double precision version
+void solve_pde_fft(pfstmo::Array2Dd *F, pfstmo::Array2Dd *U, bool adjust_bound)
+{
+  subtract(U, solve_pde_dct(F, U, adjust_bound));
 }
 
 // solves Laplace U = F
-// single precision version (right now simply calls the double prec version)
-void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound)
+// single precision version, either natively with fftwf or by calling the
+// double precision version
+void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound,
+                   bool single_precision)
 {
   int width = F->getCols();
   int height = F->getRows();
   assert((int)U->getCols()==width && (int)U->getRows()==height);
 
-  pfstmo::Array2Dd* Fd = new pfstmo::Array2Dd(width,height);
-  pfstmo::Array2Dd* Ud = new pfstmo::Array2Dd(width,height);
+#ifdef HAVE_FFTW3F
+  if(single_precision)
+  {
+    // the first transform goes from F into U, the second is in place
+    subtract(U, solve_pde_dct(F, U, adjust_bound));
+    return;
+  }
+#endif
+
+  // a single double array for the right hand side and the solution
+  pfstmo::Array2Dd* D = new pfstmo::Array2Dd(width,height);
+  double* d = D->getRawData();
+  const float* f = F->getRawData();
+  float* u = U->getRawData();
 
   // convert float array to double array
+  #pragma omp parallel for
   for(int i=0; i<width*height; i++)
-    (*Fd)(i)=(*F)(i);
+    d[i]=f[i];
 
-  solve_pde_fft(Fd,Ud,adjust_bound);
+  double max=solve_pde_dct(D,D,adjust_bound);
 
-  // convert float array to double array
+  // convert double array to float array, removing the maximum
+  #pragma omp parallel for
   for(int i=0; i<width*height; i++)
-    (*U)(i)=(*Ud)(i);
+    u[i]=d[i]-max;
+
+  delete D;
 }
 
 // ---------------------------------------------------------------------
@@ -379,7 +508,9 @@ double error_estim_pde_fft_d(unsigned int width, unsigned int height)
 //    2000x3000: 1.1*10^-5
 //     640x 480: 1.6*10^-6
 //      10x  10: 4.3*10^-8
-double error_estim_pde_fft(unsigned int width, unsigned int height)
+// with single_precision the transforms themselves run in float
+double error_estim_pde_fft(unsigned int width, unsigned int height,
+                           bool single_precision)
 {
   pfstmo::Array2D* F = new pfstmo::Array2D(width,height);
   pfstmo::Array2D* Uexact = new pfstmo::Array2D(width,height);
@@ -393,7 +524,7 @@ double error_estim_pde_fft(unsigned int width, unsigned int height)
   laplace_fft(Uexact, F);
 
   // solve equation Laplace U = F
-  solve_pde_fft(F, U, false);
+  solve_pde_fft(F, U, false, single_precision);
 
   // compare U with exact result Uexact, difference must be a constant
   double mean=0.0;
@@ -0,0 +1,186 @@
+/**
+ * @file pipeline.h
+ * @brief Stage pipeline over a batch of items
+ *
+ * Every stage runs on its own thread with its own OpenMP team size and
+ * hands items to the next stage through a bounded queue, so different
+ * stages work on different items at the same time.
+ */
+
+#ifndef _pipeline_h_
+#define _pipeline_h_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <ostream>
+#include <stdio.h>
+#include <sys/time.h>
+#include <omp.h>
+
+template<class T>
+class BoundedQueue
+{
+	std::deque<T> items;
+	size_t capacity;
+	std::mutex queueMutex;
+	std::condition_variable notFull, notEmpty;
+
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+	void push(const T& item)
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		while (items.size() >= capacity)
+			notFull.wait(lock);
+		items.push_back(item);
+		lock.unlock();
+		notEmpty.notify_one();
+	}
+
+	T pop()
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		while (items.empty())
+			notEmpty.wait(lock);
+		T item = items.front();
+		items.pop_front();
+		lock.unlock();
+		notFull.notify_one();
+		return item;
+	}
+};
+
+template<class Item>
+class StagePipeline
+{
+public:
+	/// processes one item, index is its position in the batch
+	typedef std::function<void(Item& item, size_t index)> Work;
+
+private:
+	struct Stage
+	{
+		std::string name;
+		int threads;		// OpenMP team size of the stage thread
+		Work work;
+		double busy;		// seconds spent in work
+		double starved;		// seconds waiting for input
+		double blocked;		// seconds waiting for room downstream
+	};
+
+	std::vector<Stage> stages;
+	double wallTime;
+
+	static double now()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.0;
+	}
+
+public:
+	StagePipeline() : wallTime(0) {}
+
+	void addStage(const std::string& name, int threads, Work work)
+	{
+		Stage stage = {name, threads, work, 0, 0, 0};
+		stages.push_back(stage);
+	}
+
+	/**
+	 * Passes all items through the stages in order. At most depth items
+	 * wait between two stages. After the first exception the remaining
+	 * items are drained without work and the exception is rethrown.
+	 */
+	void run(std::vector<Item>& items, size_t depth)
+	{
+		const size_t count = stages.size();
+		std::vector<BoundedQueue<Item*>*> queues;
+		for (size_t s = 0; s + 1 < count; s++)
+			queues.push_back(new BoundedQueue<Item*>(depth));
+
+		std::atomic<bool> failed(false);
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		double start = now();
+		std::vector<std::thread> threads;
+		for (size_t s = 0; s < count; s++) {
+			threads.push_back(std::thread([&, s]() {
+				Stage& stage = stages[s];
+				omp_set_num_threads(stage.threads);
+				for (size_t i = 0; ; i++) {
+					// NULL marks the end of the batch
+					double t0 = now();
+					Item* item = NULL;
+					if (s == 0)
+						item = i < items.size() ? &items[i] : NULL;
+					else
+						item = queues[s - 1]->pop();
+					double t1 = now();
+					stage.starved += t1 - t0;
+
+					if (item != NULL && !failed) {
+						try {
+							stage.work(*item, item - &items[0]);
+						}
+						catch (...) {
+							std::lock_guard<std::mutex> lock(errorMutex);
+							if (!failed) {
+								error = std::current_exception();
+								failed = true;
+							}
+						}
+					}
+					double t2 = now();
+					stage.busy += t2 - t1;
+
+					if (s + 1 < count)
+						queues[s]->push(item);
+					stage.blocked += now() - t2;
+
+					if (item == NULL)
+						break;
+				}
+			}));
+		}
+		for (size_t s = 0; s < count; s++)
+			threads[s].join();
+		wallTime = now() - start;
+
+		for (size_t s = 0; s < queues.size(); s++)
+			delete queues[s];
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	/**
+	 * Prints the share of the last run each stage spent working, waiting
+	 * for input and waiting for the next stage. The stage with the
+	 * highest busy share limits the throughput.
+	 */
+	void printOccupancy(std::ostream& out) const
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "%-10s %7s %6s %8s %8s", "stage", "threads", "busy", "starved", "blocked");
+		out << line << std::endl;
+		for (size_t s = 0; s < stages.size(); s++) {
+			const Stage& stage = stages[s];
+			double scale = wallTime > 0 ? 100.0 / wallTime : 0;
+			snprintf(line, sizeof(line), "%-10s %7d %5.1f%% %7.1f%% %7.1f%%", stage.name.c_str(), stage.threads,
+					 stage.busy * scale, stage.starved * scale, stage.blocked * scale);
+			out << line << std::endl;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,25 @@
+#!/bin/python
+
+# Usage: ./main --serve /tmp/tone.sock, then python serve.py /tmp/tone.sock
+# sends the images to the running server one request per line and prints
+# the replies ("ok <seconds>" or "error <message>")
+
+import socket
+import sys
+
+task = [i for i in range(1, 19 + 1)]
+
+client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+client.connect(sys.argv[1] if len(sys.argv) > 1 else "/tmp/tone.sock")
+replies = client.makefile("r")
+
+for i in task:
+	exrFile = "ori/render_result_nm_ori_%s.exr" % i
+	mapFile = "map/map_%s.png" % i
+	simpleFile = "simple/simple_%s.png" % i
+	fusionFile = "fusion/fusion_%s.png" % i
+
+	client.sendall(("%s %s %s %s\n" % (exrFile, mapFile, simpleFile, fusionFile)).encode())
+	print("%s: %s" % (exrFile, replies.readline().strip()))
+
+client.close()
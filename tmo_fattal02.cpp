@@ -37,12 +37,14 @@
 #include <algorithm>
 
 #include <math.h>
+#include <stdlib.h>
 
 #include <assert.h>
 #include <pfs.h>
 
 #include "pfstmo.h"
 #include "pde.h"
+#include "tmo_fattal02.h"
 
 using namespace std;
 
@@ -50,11 +52,21 @@ using namespace std;
 #if !defined(HAVE_FFTW3) || !defined(HAVE_OpenMP)
 
 // Dummy function, compiled when FFTW3 not available
-void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound)
+void solve_pde_fft(pfstmo::Array2D *F, pfstmo::Array2D *U, bool adjust_bound,
+                   bool single_precision)
 {
 	throw pfs::Exception("FFT solver not available. Compile with libfftw3.");
 }
 
+void pde_fft_set_planning(PdeFftPlanning effort, const char* wisdom_file)
+{
+}
+
+void pde_fft_timing(double& planning, double& execution)
+{
+	planning = execution = 0.0;
+}
+
 #endif
 
 //for debugging purposes
@@ -83,250 +95,589 @@ static void dumpPFS( const char *fileName, const pfstmo::Array2D *data, const ch
 
 //--------------------------------------------------------------------
 
-void downSample(pfstmo::Array2D* A, pfstmo::Array2D* B)
-{
-	int width = B->getCols();
-	int height = B->getRows();
-	int x,y;
+// logf and expf in the Cephes formulation, written without branches or
+// calls so that "omp simd" loops vectorise them. Both are within 1 ulp of
+// the correctly rounded result, logApprox for positive normal x and
+// expApprox for -87 < x < 88, to which its argument is clamped.
 
-	for( y=0 ; y<height ; y++ )
-		for( x=0 ; x<width ; x++ )
-		{
-			(*B)(x,y) = ((*A)(2*x,2*y) + (*A)(2*x+1,2*y) + (*A)(2*x,2*y+1) + (*A)(2*x+1,2*y+1)) / 4.0f;
-		}	
+static inline float logApprox(float x)
+{
+	unsigned int bits;
+	memcpy(&bits, &x, sizeof(bits));
+	float e = (float)((int)(bits>>23) - 126);
+	bits = (bits & 0x007fffffu) | 0x3f000000u;		// mantissa in [0.5,1)
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+
+	bool small = m < 0.707106781186547524f;
+	e = small ? e-1.0f : e;
+	m = small ? m+m-1.0f : m-1.0f;
+
+	float z = m*m;
+	float y = 7.0376836292E-2f;
+	y = y*m - 1.1514610310E-1f;
+	y = y*m + 1.1676998740E-1f;
+	y = y*m - 1.2420140846E-1f;
+	y = y*m + 1.4249322787E-1f;
+	y = y*m - 1.6668057665E-1f;
+	y = y*m + 2.0000714765E-1f;
+	y = y*m - 2.4999993993E-1f;
+	y = y*m + 3.3333331174E-1f;
+	y = y*m*z;
+	y += -2.12194440e-4f*e;
+	y += -0.5f*z;
+	return m + y + 0.693359375f*e;
 }
-	
-void gaussianBlur( pfstmo::Array2D* I, pfstmo::Array2D* L )
+
+static inline float expApprox(float x)
 {
-	int width = I->getCols();
-	int height = I->getRows();
-	int size = width*height;
+	x = x < 88.0f ? x : 88.0f;
+	x = x > -87.0f ? x : -87.0f;
+
+	float n = floorf(1.44269504088896341f*x + 0.5f);
+	x -= n*0.693359375f;
+	x -= n*-2.12194440e-4f;
+
+	float z = x*x;
+	float y = 1.9875691500E-4f;
+	y = y*x + 1.3981999507E-3f;
+	y = y*x + 8.3334519073E-3f;
+	y = y*x + 4.1665795894E-2f;
+	y = y*x + 1.6666665459E-1f;
+	y = y*x + 5.0000001201E-1f;
+	y = y*z + x + 1.0f;
+
+	unsigned int bits = (unsigned int)((int)n + 127) << 23;	// 2^n
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return y*scale;
+}
 
-	pfstmo::Array2D* T = new pfstmo::Array2D(width,height);
+//--------------------------------------------------------------------
 
-	//--- X blur
-	#pragma omp parallel for
-	for(int y=0 ; y<height ; y++ )
+// [1 2 1]/4 blur of the first cols values of row in into out
+static void blurRowX( const float* in, float* out, int width, int cols )
+{
+	out[0] = ( 3*in[0]+in[1] ) / 4.0f;
+	int interior = cols<width ? cols : width-1;
+	for(int x=1 ; x<interior ; x++ )
 	{
-		for(int x=1 ; x<width-1 ; x++ )
-		{
-			float t = 2*(*I)(x,y);
-			t += (*I)(x-1,y);
-			t += (*I)(x+1,y);
-			(*T)(x,y) = t/4.0f;
-		}
-		(*T)(0,y) = ( 3*(*I)(0,y)+(*I)(1,y) ) / 4.0f;
-		(*T)(width-1,y) = ( 3*(*I)(width-1,y)+(*I)(width-2,y) ) / 4.0f;
+		float t = 2*in[x];
+		t += in[x-1];
+		t += in[x+1];
+		out[x] = t/4.0f;
 	}
+	if( cols==width )
+		out[width-1] = ( 3*in[width-1]+in[width-2] ) / 4.0f;
+}
 
-	//--- Y blur
-	#pragma omp parallel for
-	for(int x=0 ; x<width ; x++ )
-	{
-		for(int y=1 ; y<height-1 ; y++ )
+// [1 2 1]/4 blur across the X blurred rows prev, cur and next of row y
+static void blurRowY( const float* prev, const float* cur, const float* next,
+	float* out, int y, int height, int cols )
+{
+	if( y==0 )
+		for(int x=0 ; x<cols ; x++ )
+			out[x] = ( 3*cur[x]+next[x] ) / 4.0f;
+	else if( y==height-1 )
+		for(int x=0 ; x<cols ; x++ )
+			out[x] = ( 3*cur[x]+prev[x] ) / 4.0f;
+	else
+		for(int x=0 ; x<cols ; x++ )
 		{
-			float t = 2*(*T)(x,y);
-			t += (*T)(x,y-1);
-			t += (*T)(x,y+1);
-			(*L)(x,y) = t/4.0f;
+			float t = 2*cur[x];
+			t += prev[x];
+			t += next[x];
+			out[x] = t/4.0f;
 		}
-		(*L)(x,0) = ( 3*(*T)(x,0)+(*T)(x,1) ) / 4.0f;
-		(*L)(x,height-1) = ( 3*(*T)(x,height-1)+(*T)(x,height-2) ) / 4.0f;
-	}
-
-	delete T;
 }
 
-void createGaussianPyramids( pfstmo::Array2D* H, pfstmo::Array2D** pyramids, int nlevels )
+// gradient magnitudes of row h of a pyramid level into g, using the rows
+// n above and s below (clamped to the level) and central differences
+// scaled by 1/2^(k+1); returns their sum
+//
+// note this implicitely assumes that H(-1)=H(0)
+// for the fft-pde slover this would need adjustment as H(-1)=H(1)
+// is assumed, which means gx=0.0, gy=0.0 at the boundaries
+// however, the impact is not visible so we ignore this here
+static double gradientRow( const float* h, const float* n, const float* s,
+	float* g, int width, float scale )
 {
-	int width = H->getCols();
-	int height = H->getRows();
-	int size = width*height;
+	int last = width-1;
+	float gx, gy;
 
-	pyramids[0] = new pfstmo::Array2D(width,height);
-	for( int i=0 ; i<size ; i++ )
-		(*pyramids[0])(i) = (*H)(i);
+	gx = (h[0]-h[1]) * scale;
+	gy = (s[0]-n[0]) * scale;
+	g[0] = sqrtf(gx*gx+gy*gy);
+	float sum = g[0];
 
-	pfstmo::Array2D* L = new pfstmo::Array2D(width,height);
-	gaussianBlur( pyramids[0], L );
-	
-	for( int k=1 ; k<nlevels ; k++ )
+	#pragma omp simd reduction(+: sum)
+	for( int x=1 ; x<last ; x++ )
 	{
-		width /= 2;
-		height /= 2;		
-		pyramids[k] = new pfstmo::Array2D(width,height);
-		downSample(L, pyramids[k]);
-		
-		delete L;
-		L = new pfstmo::Array2D(width,height);
-		gaussianBlur( pyramids[k], L );
+		float gxi = (h[x-1]-h[x+1]) * scale;
+		float gyi = (s[x]-n[x]) * scale;
+		g[x] = sqrtf(gxi*gxi+gyi*gyi);
+		sum += g[x];
 	}
 
-	delete L;
+	gx = (h[last-1]-h[last]) * scale;
+	gy = (s[last]-n[last]) * scale;
+	g[last] = sqrtf(gx*gx+gy*gy);
+	return (double)sum + g[last];
 }
 
-//--------------------------------------------------------------------
+// gradientRow() for row y of level k
+static double gradientRow( pfstmo::Array2D* A, pfstmo::Array2D* G, int y, int k )
+{
+	int width = A->getCols();
+	int height = A->getRows();
+	const float* a = A->getRawData();
+	int n = y>0 ? y-1 : 0;
+	int s = y+1<height ? y+1 : y;
+	return gradientRow( a + (size_t)y*width, a + (size_t)n*width, a + (size_t)s*width,
+		G->getRawData() + (size_t)y*width, width, 1.0f / (2<<k) );
+}
 
-float calculateGradients(pfstmo::Array2D* H, pfstmo::Array2D* G, int k)
+// B is A blurred with [1 2 1]/4 in both directions and averaged over 2x2
+// blocks, done in one pass over the rows of B. Every thread works on a
+// contiguous band of rows and keeps the X blurred rows of A in a ring of
+// four, so each is computed once; the odd last row and column of A, which
+// the decimation drops, are not blurred at all.
+//
+// While its rows are in cache the gradients G of A, level k, are taken
+// as well, with the row sums in rowSums. Returns the number of rows of G
+// done, all but an odd last one.
+static int blurDownSample( pfstmo::Array2D* A, pfstmo::Array2D* B,
+	pfstmo::Array2D* G, double* rowSums, int k )
 {
-	int width = H->getCols();
-	int height = H->getRows();
-	float divider = pow( 2.0f, k+1 );
-	float avgGrad = 0.0f;
+	int width = A->getCols();
+	int height = A->getRows();
+	int bwidth = B->getCols();
+	int bheight = B->getRows();
+	int cols = 2*bwidth;
 
-	#pragma omp parallel for reduction(+: avgGrad)  
-	for( int y=0 ; y<height ; y++ )
+	#pragma omp parallel
 	{
-		for( int x=0 ; x<width ; x++ )
+		std::vector<float> buffer(6*width);
+		float* ring[4];
+		int ringRow[4];
+		for( int i=0 ; i<4 ; i++ )
 		{
-			float gx, gy;
-			int w, n, e, s;
-			w = (x == 0 ? 0 : x-1);
-			n = (y == 0 ? 0 : y-1);
-			s = (y+1 == height ? y : y+1);
-			e = (x+1 == width ? x : x+1);
+			ring[i] = &buffer[i*width];
+			ringRow[i] = -1;
+		}
+		float* b0 = &buffer[4*width];
+		float* b1 = &buffer[5*width];
 
-			gx = ((*H)(w,y)-(*H)(e,y)) / divider;
-				
-			gy = ((*H)(x,s)-(*H)(x,n)) / divider;
+		#pragma omp for schedule(static)
+		for( int y=0 ; y<bheight ; y++ )
+		{
+			// X blurred rows 2y-1 .. 2y+2, clamped to the image
+			const float* t[4];
+			for( int i=0 ; i<4 ; i++ )
+			{
+				int r = 2*y-1+i;
+				r = r<0 ? 0 : (r>=height ? height-1 : r);
+				if( ringRow[r&3]!=r )
+				{
+					blurRowX(A->getRawData() + (size_t)r*width, ring[r&3], width, cols);
+					ringRow[r&3] = r;
+				}
+				t[i] = ring[r&3];
+			}
 
-			// note this implicitely assumes that H(-1)=H(0)
-			// for the fft-pde slover this would need adjustment as H(-1)=H(1)
-			// is assumed, which means gx=0.0, gy=0.0 at the boundaries
-			// however, the impact is not visible so we ignore this here
+			blurRowY(t[0], t[1], t[2], b0, 2*y, height, cols);
+			blurRowY(t[1], t[2], t[3], b1, 2*y+1, height, cols);
 
+			float* out = B->getRawData() + (size_t)y*bwidth;
+			for( int x=0 ; x<bwidth ; x++ )
+				out[x] = (b0[2*x] + b0[2*x+1] + b1[2*x] + b1[2*x+1]) / 4.0f;
 
-			(*G)(x,y) = sqrt(gx*gx+gy*gy);
-			avgGrad += (*G)(x,y);
+			rowSums[2*y] = gradientRow(A, G, 2*y, k);
+			rowSums[2*y+1] = gradientRow(A, G, 2*y+1, k);
 		}
 	}
+	return 2*bheight;
+}
 
-	return avgGrad / (width*height);
+// builds pyramid levels 1 .. nlevels-1 (level 0 is H itself) together with
+// the gradient magnitudes and their averages of every level
+void createPyramidsAndGradients( FattalWorkspace* ws, int nlevels )
+{
+	double* rowSums = &ws->rowSums[0];
+	for( int k=0 ; k<nlevels ; k++ )
+	{
+		pfstmo::Array2D* A = ws->pyramids[k];
+		pfstmo::Array2D* G = ws->gradients[k];
+		int height = A->getRows();
+
+		int done = 0;
+		if( k+1<nlevels )
+			done = blurDownSample(A, ws->pyramids[k+1], G, rowSums, k);
+
+		#pragma omp parallel for
+		for( int y=done ; y<height ; y++ )
+			rowSums[y] = gradientRow(A, G, y, k);
+
+		// summed in row order, so the average does not depend on the threads
+		double sum = 0.0;
+		for( int y=0 ; y<height ; y++ )
+			sum += rowSums[y];
+		ws->avgGrad[k] = sum / ((double)A->getCols()*height);
+		rowSums += height;
+	}
 }
 
 //--------------------------------------------------------------------
 
-void upSample(pfstmo::Array2D* A, pfstmo::Array2D* B)
+// attenuation of a gradient of level k, a is alfa times the average
+// gradient of the level; the same as a/(grad+noise) * pow((grad+noise)/a, beta)
+static inline float attenuation(float grad, float a, float beta, float noise)
 {
-	int width = B->getCols();
-	int height = B->getRows();
-	int awidth = A->getCols();
-	int aheight = A->getRows();
-	int x,y;
-
-	for( y=0 ; y<height ; y++ )
-		for( x=0 ; x<width ; x++ )
-		{
-			int ax = x/2;
-			int ay = y/2;
-			ax = (ax<awidth) ? ax : awidth-1;
-			ay = (ay<aheight) ? ay : aheight-1;
-			
-			(*B)(x,y) = (*A)(ax,ay);
-		}
-//--- this code below produces 'use of uninitialized value error'
-//   int width = A->getCols();
-//   int height = A->getRows();
-//   int x,y;
-
-//   for( y=0 ; y<height ; y++ )
-//     for( x=0 ; x<width ; x++ )
-//     {
-//       (*B)(2*x,2*y) = (*A)(x,y);
-//       (*B)(2*x+1,2*y) = (*A)(x,y);
-//       (*B)(2*x,2*y+1) = (*A)(x,y);
-//       (*B)(2*x+1,2*y+1) = (*A)(x,y);
-//     }	
+	//TODO: non-continuous cutoff, better: if( grad<=1e-4 ) grad=1e-4;
+	return grad>1e-4f ? expApprox( (beta-1.0f)*logApprox((grad+noise)/a) ) : 1.0f;
 }
 
-void calculateFiMatrix(pfstmo::Array2D* FI, pfstmo::Array2D* gradients[], 
-	float avgGrad[], int nlevels, int detail_level,
+// fi[0] receives the result. Every finer level is the coarser one
+// upsampled (nearest neighbour), blurred and multiplied by its own
+// attenuation in one row-parallel pass; the threads keep the X blurred
+// rows of the coarser level in a ring as in blurDownSample().
+void calculateFiMatrix(FattalWorkspace* ws, int nlevels, int detail_level,
 	float alfa, float beta, float noise)
 {
-	int width = gradients[nlevels-1]->getCols();
-	int height = gradients[nlevels-1]->getRows();
-	int k;
-	pfstmo::Array2D** fi = new pfstmo::Array2D*[nlevels];
-
-	fi[nlevels-1] = new pfstmo::Array2D(width,height);
-	for( k=0 ; k<width*height ; k++ )
-		(*fi[nlevels-1])(k) = 1.0f;
-	
-	for( k=nlevels-1 ; k>=0 ; k-- )
+	std::vector<pfstmo::Array2D*>& fi = ws->fi;
+	std::vector<pfstmo::Array2D*>& gradients = ws->gradients;
+	int maxWidth = gradients[0]->getCols();
+
+	#pragma omp parallel
 	{
-		width = gradients[k]->getCols();
-		height = gradients[k]->getRows();
-		// only apply gradients to levels>=detail_level but at least to the coarsest
-		if(k>=detail_level || k==nlevels-1)
-		{    
-			DEBUG_STR << "calculateFiMatrix: apply gradient to level " << k << endl;
+		std::vector<float> buffer(5*maxWidth);
+		float* upsampled = &buffer[4*maxWidth];
+		float* ring[4];
+		int ringRow[4];
+		for( int i=0 ; i<4 ; i++ )
+			ring[i] = &buffer[i*maxWidth];
+
+		for( int k=nlevels-1 ; k>=0 ; k-- )
+		{
+			int width = gradients[k]->getCols();
+			int height = gradients[k]->getRows();
+			// only apply gradients to levels>=detail_level but at least to the coarsest
+			bool apply = k>=detail_level || k==nlevels-1;
+			float a = alfa * ws->avgGrad[k];
+			if( apply )
+			{
+				#pragma omp master
+				DEBUG_STR << "calculateFiMatrix: apply gradient to level " << k << endl;
+			}
+
+			int cwidth = k+1<nlevels ? fi[k+1]->getCols() : 0;
+			int cheight = k+1<nlevels ? fi[k+1]->getRows() : 0;
+			for( int i=0 ; i<4 ; i++ )
+				ringRow[i] = -1;
+
+			#pragma omp for schedule(static)
 			for( int y=0 ; y<height ; y++ )
-				for( int x=0 ; x<width ; x++ )
+			{
+				float* out = fi[k]->getRawData() + (size_t)y*width;
+				const float* grad = gradients[k]->getRawData() + (size_t)y*width;
+
+				if( k==nlevels-1 )
 				{
-					float grad = (*gradients[k])(x,y);
-					float a = alfa * avgGrad[k];
-
-					float value=1.0;
-					//TODO: simpler: value = pow((grad+noise)/a, beta-1.0f);
-					//TODO: non-continuous cutoff, better: if( grad<=1e-4 ) grad=1e-4;
-					if( grad>1e-4 )
-						value = a/(grad+noise) * pow((grad+noise)/a, beta);
-					(*fi[k])(x,y) *= value;
+					for( int x=0 ; x<width ; x++ )
+						out[x] = attenuation(grad[x], a, beta, noise);
+					continue;
 				}
-		}
-		
-		// create next level
-		if( k>1 )
-		{
-			width = gradients[k-1]->getCols();
-			height = gradients[k-1]->getRows();
-			fi[k-1] = new pfstmo::Array2D(width,height);
-		}
-		else
-			fi[0] = FI;               // highest level -> result
 
-		if( k>0 )
-		{
-			upSample(fi[k], fi[k-1]);		// upsample to next level
-			gaussianBlur(fi[k-1],fi[k-1]);
+				// X blurred upsampled rows y-1 .. y+1, which come from the
+				// coarser rows (y-1)/2 .. (y+1)/2
+				const float* t[3];
+				for( int i=0 ; i<3 ; i++ )
+				{
+					int r = y-1+i;
+					r = r<0 ? 0 : (r>=height ? height-1 : r);
+					int cr = r/2<cheight ? r/2 : cheight-1;
+					if( ringRow[cr&3]!=cr )
+					{
+						const float* coarse = fi[k+1]->getRawData() + (size_t)cr*cwidth;
+						for( int x=0 ; x<width ; x++ )
+							upsampled[x] = coarse[x/2<cwidth ? x/2 : cwidth-1];
+						blurRowX(upsampled, ring[cr&3], width, width);
+						ringRow[cr&3] = cr;
+					}
+					t[i] = ring[cr&3];
+				}
+
+				blurRowY(t[0], t[1], t[2], out, y, height, width);
+				if( apply )
+					for( int x=0 ; x<width ; x++ )
+						out[x] *= attenuation(grad[x], a, beta, noise);
+			}
 		}
 	}
-
-	for( k=1 ; k<nlevels ; k++ )
-		delete fi[k];
-	delete[] fi;
 }
 
 //--------------------------------------------------------------------
 
 
+// maps a float to an unsigned int of the same order
+static inline unsigned int orderKey(float v)
+{
+	unsigned int bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// returns the element of rank k (0 based) among the non-zero values of I
+// whose key falls into bin, which holds the ranks from binStart on
+static float selectInBin(pfstmo::Array2D* I, int shift, unsigned int bin,
+	size_t binStart, size_t k)
+{
+	int size = I->getRows() * I->getCols();
+	std::vector<float> vBin;
+
+	#pragma omp parallel
+	{
+		std::vector<float> local;
+		#pragma omp for nowait
+		for( int i=0 ; i<size ; i++ )
+			if( (*I)(i)!=0.0f && (orderKey((*I)(i))>>shift)==bin )
+				local.push_back((*I)(i));
+		#pragma omp critical
+		vBin.insert(vBin.end(), local.begin(), local.end());
+	}
+
+	std::nth_element(vBin.begin(), vBin.begin() + (k-binStart), vBin.end());
+	return vBin[k-binStart];
+}
+
+// same result as sorting the non-zero values and picking the percentiles,
+// but in linear time: a histogram over the top bits of the values finds
+// the bins holding the two ranks, and only those bins are searched
 static void findMaxMinPercentile(pfstmo::Array2D* I, float minPrct, float& minLum, 
 	float maxPrct, float& maxLum)
 {
+	const int shift = 20;				// 4096 bins, 1/8 octave each
+	const int nbins = 1 << (32-shift);
 	int size = I->getRows() * I->getCols();
-	std::vector<float> vI;
+	std::vector<size_t> hist(nbins, 0);
+
+	#pragma omp parallel
+	{
+		std::vector<size_t> local(nbins, 0);
+		#pragma omp for nowait
+		for( int i=0 ; i<size ; i++ )
+			if( (*I)(i)!=0.0f )          //TODO: remove this, no point ignoring 0's
+				local[orderKey((*I)(i))>>shift]++;
+		#pragma omp critical
+		for( int b=0 ; b<nbins ; b++ )
+			hist[b] += local[b];
+	}
+
+	size_t n = 0;
+	for( int b=0 ; b<nbins ; b++ )
+		n += hist[b];
+	if( n==0 )
+		throw pfs::Exception("tmo_fattal02: image is black");
 
-	for( int i=0 ; i<size ; i++ )
-		if( (*I)(i)!=0.0f )          //TODO: remove this, no point ignoring 0's
-			vI.push_back((*I)(i));
-			
-	std::sort(vI.begin(), vI.end());
+	size_t kmin = std::min( size_t(int(minPrct*n)), n-1 );
+	size_t kmax = std::min( size_t(int(maxPrct*n)), n-1 );
 
-	minLum = vI.at( int(minPrct*vI.size()) );
-	maxLum = vI.at( int(maxPrct*vI.size()) );
+	size_t binStart = 0;
+	for( int b=0 ; b<nbins ; b++ )
+	{
+		size_t binEnd = binStart + hist[b];
+		if( kmin>=binStart && kmin<binEnd )
+			minLum = selectInBin(I, shift, b, binStart, kmin);
+		if( kmax>=binStart && kmax<binEnd )
+			maxLum = selectInBin(I, shift, b, binStart, kmax);
+		binStart = binEnd;
+	}
 }
 
 //--------------------------------------------------------------------
 
-void tmo_fattal02(unsigned int width, unsigned int height,
-									const float* nY, float* nL, float alfa, float beta,
-									float gamma, float noise, int detail_level,
-									float black_point, float white_point, bool fftsolver)
+//--------------------------------------------------------------------
+
+// one divergence value of the attenuated gradients for the fft solver,
+// which assumes H(N)=H(N-2) past the last row and column and gets the
+// gradient across the first row and column added back. The gradients are
+// forward differences weighted by the mean FI of both points; xe is x+1
+// mirrored at the right edge, the rows s and n are below and above y.
+static inline float divergenceFFT(const float* h, const float* f,
+	const float* hs, const float* fs, const float* hn, const float* fn,
+	int x, int xe, int y)
 {
+	float gx = (h[xe]-h[x]) * 0.5f*(f[xe]+f[x]);
+	float gy = (hs[x]-h[x]) * 0.5f*(fs[x]+f[x]);
+	float div = gx + gy;
+	if( x > 0 ) div -= (h[x]-h[x-1]) * 0.5f*(f[x]+f[x-1]);
+	if( y > 0 ) div -= (h[x]-hn[x]) * 0.5f*(f[x]+fn[x]);
+	if( x==0 ) div += gx;
+	if( y==0 ) div += gy;
+	return div;
+}
 
-	const pfstmo::Array2D* Y = new pfstmo::Array2D(width, height, const_cast<float*>(nY));
-	pfstmo::Array2D* L = new pfstmo::Array2D(width, height, nL);
+// the same for the multigrid solver, which assumes H(N)=H(N-1), with
+// the gradient weighted by FI at its start point
+static inline float divergenceMultigrid(const float* h, const float* f,
+	const float* hs, const float* hn, const float* fn,
+	int x, int xe, int y)
+{
+	float gx = (h[xe]-h[x]) * f[x];
+	float gy = (hs[x]-h[x]) * f[x];
+	float div = gx + gy;
+	if( x > 0 ) div -= (h[x]-h[x-1]) * f[x-1];
+	if( y > 0 ) div -= (h[x]-hn[x]) * fn[x];
+	return div;
+}
+
+// attenuates the gradients of H by FI and returns their divergence in
+// DivG, without storing the gradients
+static void attenuatedDivergence(pfstmo::Array2D* H, pfstmo::Array2D* FI,
+	pfstmo::Array2D* DivG, bool fftsolver)
+{
+	int width = H->getCols();
+	int height = H->getRows();
+
+	// the fft solver solves the Poisson pde but with slightly different
+	// boundary conditions, so we need to adjust the assembly of the right hand
+	// side accordingly (basically fft solver assumes U(-1) = U(1), whereas zero
+	// Neumann conditions assume U(-1)=U(0))
+	#pragma omp parallel for
+	for( int y=0 ; y<height ; y++ )
+	{
+		int s = y+1<height ? y+1 : (fftsolver ? height-2 : y);
+		int n = y>0 ? y-1 : y;
+		const float* h = H->getRawData() + (size_t)y*width;
+		const float* f = FI->getRawData() + (size_t)y*width;
+		const float* hs = H->getRawData() + (size_t)s*width;
+		const float* fs = FI->getRawData() + (size_t)s*width;
+		const float* hn = H->getRawData() + (size_t)n*width;
+		const float* fn = FI->getRawData() + (size_t)n*width;
+		float* d = DivG->getRawData() + (size_t)y*width;
+		int last = width-1;
+
+		if( fftsolver )
+		{
+			d[0] = divergenceFFT(h, f, hs, fs, hn, fn, 0, 1, y);
+			#pragma omp simd
+			for( int x=1 ; x<last ; x++ )
+				d[x] = divergenceFFT(h, f, hs, fs, hn, fn, x, x+1, y);
+			d[last] = divergenceFFT(h, f, hs, fs, hn, fn, last, width-2, y);
+		}
+		else
+		{
+			d[0] = divergenceMultigrid(h, f, hs, hn, fn, 0, 1, y);
+			#pragma omp simd
+			for( int x=1 ; x<last ; x++ )
+				d[x] = divergenceMultigrid(h, f, hs, hn, fn, x, x+1, y);
+			d[last] = divergenceMultigrid(h, f, hs, hn, fn, last, last, y);
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+
+FattalWorkspace::FattalWorkspace() :
+	arena(NULL), capacity(0), width(0), height(0), nlevels(-1),
+	H(NULL), FI(NULL), DivG(NULL), U(NULL)
+{
+}
+
+FattalWorkspace::~FattalWorkspace()
+{
+	deleteViews();
+	free(arena);
+}
+
+void FattalWorkspace::deleteViews()
+{
+	delete H;
+	delete FI;
+	delete DivG;
+	delete U;
+	for( size_t k=0 ; k<pyramids.size() ; k++ )
+	{
+		delete gradients[k];
+		if( k>0 )
+		{
+			delete pyramids[k];		// pyramids[0] is H
+			delete fi[k];			// fi[0] is FI
+		}
+	}
+	pyramids.clear();
+	gradients.clear();
+	fi.clear();
+	H = FI = DivG = U = NULL;
+}
 
+void FattalWorkspace::reserve(unsigned int width, unsigned int height, int nlevels)
+{
+	if( width==this->width && height==this->height && nlevels==this->nlevels )
+		return;
+	deleteViews();
+	this->width = width;
+	this->height = height;
+	this->nlevels = nlevels;
+
+	// planes start on cache lines
+	const size_t align = 16;
+	size_t planeSize = ((size_t)width*height + align-1) / align * align;
+	size_t levelSize[32];
+	size_t total = 4 * planeSize;		// H, FI, DivG, U
+	for( int k=0 ; k<nlevels ; k++ )
+	{
+		levelSize[k] = ((size_t)(width>>k)*(height>>k) + align-1) / align * align;
+		total += (k>0 ? 3 : 1) * levelSize[k];	// pyramid, fi and gradient
+	}
+
+	if( total>capacity )
+	{
+		free(arena);
+		arena = NULL;
+		if( posix_memalign((void**)&arena, align*sizeof(float), total*sizeof(float))!=0 )
+		{
+			capacity = 0;
+			this->nlevels = -1;
+			throw pfs::Exception("tmo_fattal02: out of memory");
+		}
+		capacity = total;
+	}
+
+	float* next = arena;
+	H = new pfstmo::Array2D(width, height, next);		next += planeSize;
+	FI = new pfstmo::Array2D(width, height, next);		next += planeSize;
+	DivG = new pfstmo::Array2D(width, height, next);	next += planeSize;
+	U = new pfstmo::Array2D(width, height, next);		next += planeSize;
+
+	avgGrad.resize(nlevels);
+	size_t rows = 0;
+	for( int k=0 ; k<nlevels ; k++ )
+		rows += height>>k;
+	rowSums.resize(rows);
+	for( int k=0 ; k<nlevels ; k++ )
+	{
+		unsigned int w = width>>k;
+		unsigned int h = height>>k;
+		if( k==0 )
+		{
+			pyramids.push_back(H);
+			fi.push_back(FI);
+		}
+		else
+		{
+			pyramids.push_back(new pfstmo::Array2D(w, h, next));	next += levelSize[k];
+			fi.push_back(new pfstmo::Array2D(w, h, next));			next += levelSize[k];
+		}
+		gradients.push_back(new pfstmo::Array2D(w, h, next));		next += levelSize[k];
+	}
+	assert( next<=arena+capacity );
+}
+
+//--------------------------------------------------------------------
+
+int tmo_fattal02_min_size(bool fftsolver)
+{
 	int MSIZE=32;       // minimum size of gaussian pyramid (32 as in paper)
 	// I believe a smaller value than 32 results in slightly better overall
 	// quality but I'm only applying this if the newly implemented fft solver
@@ -334,25 +685,13 @@ void tmo_fattal02(unsigned int width, unsigned int height,
 	// TODO: best let the user decide this value
 	if(fftsolver)
 		 MSIZE=8;         
+	return MSIZE;
+}
 
-	int size = width*height;
-	int x,y,i,k;
-
-	// find max & min values, normalize to range 0..100 and take logarithm
-	float minLum = (*Y)(0,0);
-	float maxLum = (*Y)(0,0);
-	for( i=0 ; i<size ; i++ )
-	{
-		minLum = ( (*Y)(i)<minLum ) ? (*Y)(i) : minLum;
-		maxLum = ( (*Y)(i)>maxLum ) ? (*Y)(i) : maxLum;
-	}
-	pfstmo::Array2D* H = new pfstmo::Array2D(width, height);
-	for( i=0 ; i<size ; i++ )
-		(*H)(i) = log( 100.0f*((*Y)(i)-minLum)/(maxLum-minLum) + 1e-4 );
+int tmo_fattal02_levels(unsigned int width, unsigned int height, bool fftsolver)
+{
+	int MSIZE=tmo_fattal02_min_size(fftsolver);
 
-	DEBUG_STR << "tmo_fattal02: calculating attenuation matrix" << endl;
-	
-	// create gaussian pyramids
 	int mins = (width<height) ? width : height;	// smaller dimension
 	int nlevels = 0;
 	while( mins>=MSIZE )
@@ -360,126 +699,112 @@ void tmo_fattal02(unsigned int width, unsigned int height,
 		nlevels++;
 		mins /= 2;
 	}
-	pfstmo::Array2D** pyramids = new pfstmo::Array2D*[nlevels];
-	createGaussianPyramids(H, pyramids, nlevels);
+	return nlevels;
+}
 
-	// calculate gradients and its average values on pyramid levels
-	pfstmo::Array2D** gradients = new pfstmo::Array2D*[nlevels];
-	float* avgGrad = new float[nlevels];
-	for( k=0 ; k<nlevels ; k++ )
+int tmo_fattal02_margin(unsigned int width, unsigned int height, bool fftsolver)
+{
+	// a pixel of level k covers 2^k pixels and the [1 2 1] blur on that
+	// level reaches one more of them on each side
+	int nlevels = tmo_fattal02_levels(width, height, fftsolver);
+	return nlevels>0 ? (1<<nlevels) - 1 : 0;
+}
+
+void tmo_fattal02(unsigned int width, unsigned int height,
+									const float* nY, float* nL, float alfa, float beta,
+									float gamma, float noise, int detail_level,
+									float black_point, float white_point, bool fftsolver,
+									bool fftfloat, FattalWorkspace* workspace)
+{
+	FattalWorkspace* ws = workspace;
+	if( ws==NULL )
+		ws = new FattalWorkspace();
+	int nlevels = tmo_fattal02_levels(width, height, fftsolver);
+	if( nlevels==0 )
 	{
-		gradients[k] = new pfstmo::Array2D(pyramids[k]->getCols(), pyramids[k]->getRows());
-		avgGrad[k] = calculateGradients(pyramids[k],gradients[k], k);
+		if( workspace==NULL )
+			delete ws;
+		throw pfs::Exception("tmo_fattal02: image smaller than the coarsest pyramid level");
 	}
+	ws->reserve(width, height, nlevels);
 
-	// calculate fi matrix
-	pfstmo::Array2D* FI = new pfstmo::Array2D(width, height);
-	calculateFiMatrix(FI, gradients, avgGrad, nlevels, detail_level, alfa, beta, noise);
+	const pfstmo::Array2D* Y = new pfstmo::Array2D(width, height, const_cast<float*>(nY));
+	pfstmo::Array2D* L = new pfstmo::Array2D(width, height, nL);
 
-//  dumpPFS( "FI.pfs", FI, "Y" );
+	int size = width*height;
+	int i;
 
-	// attenuate gradients
-	pfstmo::Array2D* Gx = new pfstmo::Array2D(width, height);
-	pfstmo::Array2D* Gy = new pfstmo::Array2D(width, height);
+	// find max & min values, normalize to range 0..100 and take logarithm
+	float minLum = (*Y)(0,0);
+	float maxLum = (*Y)(0,0);
+	const float* yData = Y->getRawData();
+	#pragma omp parallel for simd reduction(min: minLum) reduction(max: maxLum)
+	for( i=0 ; i<size ; i++ )
+	{
+		minLum = ( yData[i]<minLum ) ? yData[i] : minLum;
+		maxLum = ( yData[i]>maxLum ) ? yData[i] : maxLum;
+	}
+	pfstmo::Array2D* H = ws->H;
+	float* hData = H->getRawData();
+	#pragma omp parallel for simd
+	for( i=0 ; i<size ; i++ )
+		hData[i] = logApprox( 100.0f*(yData[i]-minLum)/(maxLum-minLum) + 1e-4f );
 
-	// the fft solver solves the Poisson pde but with slightly different
-	// boundary conditions, so we need to adjust the assembly of the right hand
-	// side accordingly (basically fft solver assumes U(-1) = U(1), whereas zero
-	// Neumann conditions assume U(-1)=U(0)), see also divergence calculation
-	if(fftsolver)
-		for( y=0 ; y<(int)height ; y++ )
-			for( x=0 ; x<(int)width ; x++ )
-			{
-				// sets index+1 based on the boundary assumption H(N+1)=H(N-1)
-				int yp1 = (y+1 >= (int)height ? height-2 : y+1);
-				int xp1 = (x+1 >= (int)width ?  width-2  : x+1);
-				// forward differences in H, so need to use between-points approx of FI
-				(*Gx)(x,y) = ((*H)(xp1,y)-(*H)(x,y)) * 0.5*((*FI)(xp1,y)+(*FI)(x,y));
-				(*Gy)(x,y) = ((*H)(x,yp1)-(*H)(x,y)) * 0.5*((*FI)(x,yp1)+(*FI)(x,y));
-			}
-	else
-		for( y=0 ; y<height ; y++ )
-			for( x=0 ; x<width ; x++ )
-			{
-				int s, e;
-				s = (y+1 == height ? y : y+1);
-				e = (x+1 == width ? x : x+1);
+	DEBUG_STR << "tmo_fattal02: calculating attenuation matrix" << endl;
+	
+	// create gaussian pyramids, calculate gradients and their average
+	// values on the pyramid levels
+	createPyramidsAndGradients(ws, nlevels);
 
-				(*Gx)(x,y) = ((*H)(e,y)-(*H)(x,y)) * (*FI)(x,y);        
-				(*Gy)(x,y) = ((*H)(x,s)-(*H)(x,y)) * (*FI)(x,y);      
-			}
+	// calculate fi matrix
+	pfstmo::Array2D* FI = ws->FI;
+	calculateFiMatrix(ws, nlevels, detail_level, alfa, beta, noise);
 
+//  dumpPFS( "FI.pfs", FI, "Y" );
 
-//   dumpPFS( "Gx.pfs", Gx, "Y" );
-//   dumpPFS( "Gy.pfs", Gy, "Y" );
-	
+	// attenuate gradients and calculate their divergence
 	DEBUG_STR << "tmo_fattal02: compressing gradients" << endl;
-	
-	// calculate divergence
-	pfstmo::Array2D* DivG = new pfstmo::Array2D(width, height);
-	for( y=0 ; y<height ; y++ )
-		for( x=0 ; x<width ; x++ )
-		{
-			(*DivG)(x,y) = (*Gx)(x,y) + (*Gy)(x,y);
-			if( x > 0 ) (*DivG)(x,y) -= (*Gx)(x-1,y);
-			if( y > 0 ) (*DivG)(x,y) -= (*Gy)(x,y-1);
-
-			if(fftsolver)
-			{
-				if(x==0) (*DivG)(x,y) += (*Gx)(x,y);
-				if(y==0) (*DivG)(x,y) += (*Gy)(x,y);
-			}
-
-		}
+	pfstmo::Array2D* DivG = ws->DivG;
+	attenuatedDivergence(H, FI, DivG, fftsolver);
 
 //  dumpPFS( "DivG.pfs", DivG, "Y" );
 	
 	DEBUG_STR << "tmo_fattal02: recovering image" << endl;
 	
 	// solve pde and exponentiate (ie recover compressed image)
-	pfstmo::Array2D* U = new pfstmo::Array2D(width, height);
+	pfstmo::Array2D* U = ws->U;
 	if(fftsolver) {
-		solve_pde_fft( DivG, U );
+		solve_pde_fft( DivG, U, false, fftfloat );
 	} else {
 		// solve_pde_sor( DivG, U );
 		solve_pde_multigrid( DivG, U );
 	}
 	DEBUG_STR << "pde residual error: " << residual_pde(U, DivG) << std::endl;
 
-	for( y=0 ; y<height ; y++ )
-		for( x=0 ; x<width ; x++ )
-			(*L)(x,y) = exp( gamma*(*U)(x,y) ) - 1e-4;   //TODO: remove  1e-4
+	float* lData = L->getRawData();
+	const float* uData = U->getRawData();
+	#pragma omp parallel for simd
+	for( i=0 ; i<size ; i++ )
+		lData[i] = expApprox( gamma*uData[i] ) - 1e-4f;   //TODO: remove  1e-4
 	
 	// remove percentile of min and max values and renormalize
 	float cut_min=0.01f*black_point;
 	float cut_max=1.0f-0.01f*white_point;
 	assert(cut_min>=0.0f && (cut_max<=1.0f) && (cut_min<cut_max));
 	findMaxMinPercentile(L, cut_min, minLum, cut_max, maxLum);
-	for( y=0 ; y<height ; y++ )
-		for( x=0 ; x<width ; x++ )
-		{
-			(*L)(x,y) = ((*L)(x,y)-minLum) / (maxLum-minLum);
-			if( (*L)(x,y)<=0.0f )
-				(*L)(x,y) = 1e-4;        //TODO: set to 0.0
-			// note, we intentionally do not cut off values > 1.0
-		}
+	const float range = maxLum-minLum;
+	#pragma omp parallel for simd
+	for( i=0 ; i<size ; i++ )
+	{
+		float l = (lData[i]-minLum) / range;
+		lData[i] = l<=0.0f ? 1e-4f : l;        //TODO: set to 0.0
+		// note, we intentionally do not cut off values > 1.0
+	}
 
 	// clean up
 	DEBUG_STR << "tmo_fattal02: clean up" << endl;
-	delete H;
-	for( i=0 ; i<nlevels ; i++ )
-	{
-		delete pyramids[i];
-		delete gradients[i];
-	}
-	delete[] pyramids;
-	delete[] gradients;
-	delete[] avgGrad;
-	delete FI;
-	delete Gx;
-	delete Gy;
-	delete DivG;
-	delete U;
+	if( workspace==NULL )
+		delete ws;
 
 	delete L;
 	delete Y;
@@ -33,6 +33,48 @@
 #ifndef _tmo_fattal02_h_
 #define _tmo_fattal02_h_
 
+#include <vector>
+
+#include "pfstmo.h"
+
+/**
+ * @brief Temporary planes of tmo_fattal02, kept between calls
+ *
+ * All planes live in one aligned arena that is only reallocated when a
+ * larger image comes along, so tone mapping a series of frames of the
+ * same size neither calls the allocator nor faults in fresh pages.
+ */
+class FattalWorkspace
+{
+	float* arena;
+	size_t capacity;	// floats in arena
+	unsigned int width, height;
+	int nlevels;
+
+	void deleteViews();
+
+public:
+	pfstmo::Array2D* H;				///< log luminance, also pyramid level 0
+	pfstmo::Array2D* FI;			///< attenuation, also fi[0]
+	pfstmo::Array2D* DivG;
+	pfstmo::Array2D* U;
+	std::vector<pfstmo::Array2D*> pyramids;
+	std::vector<pfstmo::Array2D*> gradients;
+	std::vector<pfstmo::Array2D*> fi;
+	std::vector<float> avgGrad;
+	std::vector<double> rowSums;	///< gradient sums of the rows of all levels
+
+	FattalWorkspace();
+	~FattalWorkspace();
+
+	/// lays out the planes for an image of this size, reusing the arena
+	void reserve(unsigned int width, unsigned int height, int nlevels);
+
+private:
+	FattalWorkspace(const FattalWorkspace&);
+	FattalWorkspace& operator=(const FattalWorkspace&);
+};
+
 /**
  * @brief Gradient Domain High Dynamic Range Compression
  *
@@ -49,11 +91,46 @@
  * @param cut_min percentile cutoff luminosity to be excluded from final image
  * @param cut_max percentile cutoff luminosity to be excluded from final image
  * @param fftsolver whether to use the fft-solver instead of the multi-grid
+ * @param fftfloat whether the fft-solver transforms in single precision
+ * @param workspace temporaries to reuse, NULL allocates them for this call
  */
 
 void tmo_fattal02(unsigned int width, unsigned int height,
                   const float* nY, float* nL, float alfa, float beta,
                   float gamma, float noise, int detail_level,
-                  float black_point, float white_point, bool fftsolver);
+                  float black_point, float white_point, bool fftsolver,
+                  bool fftfloat = false, FattalWorkspace* workspace = NULL);
+
+/**
+ * @brief Smallest width and height the tone mapper accepts, the size of
+ * the coarsest pyramid level
+ *
+ * @param fftsolver whether the fft-solver is used (smaller minimum level)
+ */
+int tmo_fattal02_min_size(bool fftsolver);
+
+/**
+ * @brief Number of gaussian pyramid levels used for an image of this size
+ *
+ * @param width image width
+ * @param height image height
+ * @param fftsolver whether the fft-solver is used (smaller minimum level)
+ */
+int tmo_fattal02_levels(unsigned int width, unsigned int height, bool fftsolver);
+
+/**
+ * @brief Border (in pixels) a cropped region needs to see the same
+ * attenuation as in the full frame
+ *
+ * This is the footprint of the coarsest pyramid level of the full frame,
+ * ie. how far the blur-and-decimate chain spreads a pixel. The Poisson
+ * solve and the percentile normalisation remain global, so a crop only
+ * approximates the full frame result inside the border.
+ *
+ * @param width full frame width
+ * @param height full frame height
+ * @param fftsolver whether the fft-solver is used
+ */
+int tmo_fattal02_margin(unsigned int width, unsigned int height, bool fftsolver);
 
 #endif